@@ -188,3 +188,107 @@ void CTestConcur::Test_Set()
 	}
 }
 
+void CTestConcur::BenchReadLock(int nThreads, int nLoops, bool bWriter)
+{
+	CRWLock rwLock;
+	long nShared = 0;
+	std::atomic<bool> bStop(false);
+	std::thread threadWrite;
+	if (bWriter)
+	{
+		// a refresh-like writer taking the lock every millisecond
+		threadWrite = std::thread([&]()
+		{
+			while (!bStop)
+			{
+				CSafeLock safeLock(&rwLock);
+				safeLock.WriteLock();
+				++nShared;
+				safeLock.WriteUnlock();
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			}
+		});
+	}
+
+	auto start_time = std::chrono::steady_clock::now();
+	std::vector<std::thread> vecThread;
+	for (int i = 0; i < nThreads; ++i)
+	{
+		vecThread.push_back(std::thread([&]()
+		{
+			for (int j = 0; j < nLoops; ++j)
+			{
+				CSafeLock safeLock(&rwLock);
+				safeLock.ReadLock();
+				volatile long nVal = nShared;
+				(void)nVal;
+				safeLock.ReadUnlock();
+			}
+		}));
+	}
+	for (auto &thrd : vecThread)
+		thrd.join();
+	std::chrono::duration<double, std::nano> diff = std::chrono::steady_clock::now() - start_time;
+
+	bStop = true;
+	if (threadWrite.joinable())
+		threadWrite.join();
+	log_info("ReadLock [threads:", nThreads, "][writer:", bWriter, "][ns/op:", diff.count() / (double(nThreads) * nLoops), "]");
+}
+
+void CTestConcur::BenchEngine(const std::string &strHost, int port, int nThreads, int nLoops)
+{
+	if (!m_redis.Initialize(strHost, port, 3, 3, nThreads) || !m_redis.StartEngine())
+	{
+		log_error("Connect to redis failed [ip:", strHost, "][port:", port, "]");
+		return;
+	}
+
+	CRedisClient redisUring;
+	RedisSocketOpt socketOpt;
+	socketOpt.bUring = true;
+	redisUring.SetSocketOpt(socketOpt);
+	if (!redisUring.Initialize(strHost, port, 3, 3, nThreads))
+	{
+		log_error("Connect to redis failed [ip:", strHost, "][port:", port, "]");
+		return;
+	}
+
+	auto funcRun = [&](CRedisClient &redis, bool bAsync, const char *pszName)
+	{
+		std::atomic<long> nDone(0);
+		auto start_time = std::chrono::steady_clock::now();
+		std::vector<std::thread> vecThread;
+		for (int i = 0; i < nThreads; ++i)
+		{
+			vecThread.push_back(std::thread([&, i]()
+			{
+				std::string strKey = "bench_" + std::to_string(i);
+				std::string strVal;
+				std::vector<std::string> vecArg = { "get", strKey };
+				for (int j = 0; j < nLoops; ++j)
+				{
+					if (!bAsync)
+					{
+						redis.Get(strKey, &strVal);
+						++nDone;
+					}
+					else if (redis.AsyncCommand(strKey, vecArg, [&](int, redisReply *) { ++nDone; }) != RC_SUCCESS)
+						++nDone;
+				}
+			}));
+		}
+		for (auto &thrd : vecThread)
+			thrd.join();
+		while (nDone < static_cast<long>(nThreads) * nLoops)
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		std::chrono::duration<double> diff = std::chrono::steady_clock::now() - start_time;
+		log_info(pszName, " [threads:", nThreads, "][ops/s:", nThreads * double(nLoops) / diff.count(), "]");
+	};
+	funcRun(m_redis, false, "Get");
+	funcRun(redisUring, false, "Get io_uring");
+	funcRun(m_redis, true, "AsyncCommand");
+	RedisStat redisStat;
+	redisUring.GetStat(&redisStat);
+	log_info("io_uring connections: ", redisStat.nUringConn);
+}
@@ -8,6 +8,11 @@ class CTestConcur : public CTestClient
 public:
     CTestConcur();
 	virtual bool StartTest(const std::string &strHost, int port);
+	// contended read lock cost of the request path, no server needed
+	void BenchReadLock(int nThreads, int nLoops, bool bWriter);
+	// blocking Get over plain sockets and over io_uring against AsyncCommand on the I/O engine,
+	// nThreads callers doing nLoops reads each
+	void BenchEngine(const std::string &strHost, int port, int nThreads, int nLoops);
 
 private:
     void Test_GetS();
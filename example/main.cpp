@@ -47,6 +47,16 @@ int main(int argc, char **argv)
         //if (!testConcur.StartTest(strHost))
         //    break;
 
+        //CTestConcur testLock;
+        //for (int nThreads : { 1, 4, 16 })
+        //{
+        //    testLock.BenchReadLock(nThreads, 1000000, false);
+        //    testLock.BenchReadLock(nThreads, 1000000, true);
+        //}
+
+        //CTestConcur testEngine;
+        //testEngine.BenchEngine(strHost, 6379, 16, 100000);
+
         break;
     }
     return 0;
@@ -12,11 +12,21 @@
 #include <functional>
 #include <thread>
 #include <condition_variable>
+#include <mutex>
+#include <chrono>
+#include <memory>
 #include <iostream>
 #include <algorithm>
 #include <string.h>
-#include <synchapi.h>
 #include <atomic>
+#include <type_traits>
+#if defined(_WIN32)
+#include <synchapi.h>
+#endif
+
+#ifndef OUT
+#define OUT
+#endif
 
 #define RC_RESULT_EOF       5
 #define RC_NO_EFFECT        4
@@ -28,15 +38,41 @@
 #define RC_REPLY_ERR        -2
 #define RC_RQST_ERR         -3
 #define RC_NO_RESOURCE      -4
+#define RC_TIMEOUT          -5
 #define RC_NOT_SUPPORT      -6
 #define RC_SLOT_CHANGED     -100
 
 #define RQST_RETRY_TIMES    3
+#define CONNECT_FANOUT      4       // concurrent connects while a pool is opened
 #define WAIT_RETRY_TIMES    60
 
-#define FUNC_DEF_CONV       [](int nRet, redisReply *) { return nRet; }
+#define HEDGE_WINDOW_SIZE   1024
+#define HEDGE_MIN_SAMPLES   64
+
+#define SHARD_VNODE_NUM     160
+
+#define MGET_WORKERS        4       // threads shared by the MGETs of a client which span several nodes
+
+#define URING_BUF_NUM       8       // receive buffers a ring starts with, doubled whenever the kernel runs out
+#define URING_BUF_MAX       64
+#define URING_BUF_SIZE      4096
+
+#define ZEROCOPY_PENDING_MAX    8       // buffers a connection leaves with the kernel before it waits for them
+#define ZEROCOPY_WAIT_MS        100
+
+#define RECONN_BACKOFF_MIN  100
+#define RECONN_BACKOFF_MAX  10000
 
-//#define ENV_APPLY
+#define LIMIT_BLOCK         0       // a request waits for room until its deadline
+#define LIMIT_FAIL          1       // a request fails at once with RC_NO_RESOURCE
+#define LIMIT_SHED          2       // PRIO_BULK fails at once, the others wait
+
+#define PRIO_HIGH           0       // latency sensitive, may use the connections reserved for it
+#define PRIO_NORMAL         1
+#define PRIO_BULK           2       // batch work, only what the others leave
+#define PRIO_NUM            3
+
+#define FUNC_DEF_CONV       [](int nRet, redisReply *) { return nRet; }
 
 typedef std::function<int (redisReply *)> TFuncFetch;
 typedef std::function<int (int, redisReply *)> TFuncConvert;
@@ -73,44 +109,176 @@ public:
 	std::vector<RedisResult>	m_arrayVal;
 };
 
+// reader/writer lock of the request path: SRWLOCK on Windows, a futex word elsewhere (Linux).
+// writers are preferred, a waiting writer holds back new readers
+class CRWLock
+{
+public:
+#if defined(_WIN32)
+	CRWLock() { InitializeSRWLock(&m_srwLock); }
+
+	inline void LockShared() { AcquireSRWLockShared(&m_srwLock); }
+	inline void UnlockShared() { ReleaseSRWLockShared(&m_srwLock); }
+	inline void Lock() { AcquireSRWLockExclusive(&m_srwLock); }
+	inline void Unlock() { ReleaseSRWLockExclusive(&m_srwLock); }
+	inline bool TryLockShared() { return TryAcquireSRWLockShared(&m_srwLock) == TRUE; }
+	inline bool TryLock() { return TryAcquireSRWLockExclusive(&m_srwLock) == TRUE; }
+
+private:
+	SRWLOCK m_srwLock;
+#else
+	CRWLock() : m_nState(0), m_nWaitWriter(0), m_nSleeper(0) {}
+	CRWLock(const CRWLock &) = delete;
+	CRWLock &operator=(const CRWLock &) = delete;
+
+	inline void LockShared() { if (!TryLockShared()) WaitShared(); }
+	inline void UnlockShared()
+	{
+		// the last reader out lets a waiting writer in
+		if (m_nState.fetch_sub(1) == 1 && m_nSleeper > 0)
+			WakeAll();
+	}
+	inline void Lock() { if (!TryLock()) WaitExclusive(); }
+	inline void Unlock()
+	{
+		m_nState.store(0);
+		if (m_nSleeper > 0)
+			WakeAll();
+	}
+	inline bool TryLockShared()
+	{
+		uint32_t nState = m_nState.load();
+		return !(nState & WRITER_BIT) && m_nWaitWriter == 0 && m_nState.compare_exchange_weak(nState, nState + 1);
+	}
+	inline bool TryLock()
+	{
+		uint32_t nState = 0;
+		return m_nState.compare_exchange_strong(nState, WRITER_BIT);
+	}
+
+private:
+	void WaitShared();
+	void WaitExclusive();
+	void Sleep(uint32_t nState);
+	void WakeAll();
+
+	static const uint32_t WRITER_BIT = 0x80000000u;
+	std::atomic<uint32_t> m_nState;		// reader count, WRITER_BIT while a writer holds it
+	std::atomic<uint32_t> m_nWaitWriter;
+	std::atomic<uint32_t> m_nSleeper;	// threads in the futex wait, unlock skips the syscall without any
+#endif
+};
+
 class CSafeLock
 {
 public:
-	CSafeLock(PSRWLOCK pLock) : m_pLock(pLock), m_bLocked(false) {}
-	//~CSafeLock() {
-	//	WriteUnlock();
-	//	ReadUnlock();
-	//}
+	CSafeLock(CRWLock *pLock) : m_pLock(pLock), m_bLocked(false) {}
 	~CSafeLock() {};
 
 	inline bool ReadLock() 
 	{
-		AcquireSRWLockShared(m_pLock);
+		m_pLock->LockShared();
 		m_bLocked = true;
 		return m_bLocked;
 	}
 
 	inline bool WriteLock()
 	{
-		AcquireSRWLockExclusive(m_pLock);
+		m_pLock->Lock();
 		m_bLocked = true;
 		return m_bLocked;
 	}
 
-	inline bool TryReadLock(){ return (m_bLocked = (TryAcquireSRWLockShared(m_pLock) == TRUE)); }
-	inline bool TryWriteLock(){ return (m_bLocked = (TryAcquireSRWLockExclusive(m_pLock) == TRUE)); }
+	inline bool TryReadLock(){ return (m_bLocked = m_pLock->TryLockShared()); }
+	inline bool TryWriteLock(){ return (m_bLocked = m_pLock->TryLock()); }
 
-	inline void WriteUnlock() { if (true == m_bLocked) ReleaseSRWLockExclusive(m_pLock); };
-	inline void ReadUnlock() { if (m_bLocked)ReleaseSRWLockShared(m_pLock); }
+	inline void WriteUnlock() { if (true == m_bLocked) m_pLock->Unlock(); m_bLocked = false; };
+	inline void ReadUnlock() { if (m_bLocked) m_pLock->UnlockShared(); m_bLocked = false; }
 
 	inline void lock() { WriteLock(); }
 	inline void unlock() { WriteUnlock(); }
 
 private:
-	PSRWLOCK m_pLock = nullptr;
+	CRWLock *m_pLock = nullptr;
 	bool m_bLocked;
 };
 
+// cluster slot of a key, hash tags included
+uint32_t KeyHashSlot(const char *pszKey, size_t nKeyLen);
+
+// the same computation as C++11 constexpr recursion so it can run at compile time with the v140 toolset
+constexpr uint16_t ConstCrcBits(uint16_t nCrc, int nBits)
+{
+    return nBits == 0 ? nCrc :
+        ConstCrcBits(static_cast<uint16_t>((nCrc & 0x8000) ? ((nCrc << 1) ^ 0x1021) : (nCrc << 1)), nBits - 1);
+}
+
+constexpr uint16_t ConstCrc16(const char *pszData, size_t nLen, uint16_t nCrc = 0)
+{
+    return nLen == 0 ? nCrc :
+        ConstCrc16(pszData + 1, nLen - 1, ConstCrcBits(static_cast<uint16_t>(nCrc ^ (static_cast<unsigned char>(*pszData) << 8)), 8));
+}
+
+constexpr size_t ConstFind(const char *pszKey, size_t nKeyLen, char chFind, size_t nPos)
+{
+    return nPos >= nKeyLen ? nKeyLen : (pszKey[nPos] == chFind ? nPos : ConstFind(pszKey, nKeyLen, chFind, nPos + 1));
+}
+
+constexpr uint32_t ConstTagSlot(const char *pszKey, size_t nKeyLen, size_t nStart, size_t nEnd)
+{
+    return (nStart == nKeyLen || nEnd == nKeyLen || nEnd == nStart + 1) ?
+        ConstCrc16(pszKey, nKeyLen) & 16383 : ConstCrc16(pszKey + nStart + 1, nEnd - nStart - 1) & 16383;
+}
+
+constexpr uint32_t ConstKeySlot(const char *pszKey, size_t nKeyLen)
+{
+    return ConstTagSlot(pszKey, nKeyLen, ConstFind(pszKey, nKeyLen, '{', 0),
+        ConstFind(pszKey, nKeyLen, '}', ConstFind(pszKey, nKeyLen, '{', 0) + 1));
+}
+
+// slot of a string literal, usable in static_assert to check that keys share a node:
+// static_assert(HASH_SLOT_CONST("{cfg}:a") == HASH_SLOT_CONST("{cfg}:b"), "");
+template <size_t N>
+constexpr uint32_t HASH_SLOT_CONST(const char (&szKey)[N])
+{
+    return ConstKeySlot(szKey, N - 1);
+}
+
+// a key together with its slot, computed once instead of on every command.
+// REDIS_KEY("literal") computes the slot at compile time, a runtime key sharing a fixed
+// hash tag can reuse the slot of the tag: CRedisKey("{cfg}:" + strId, HASH_SLOT_CONST("{cfg}"))
+class CRedisKey
+{
+public:
+    CRedisKey(const std::string &strKey) : m_strKey(strKey), m_nSlot(KeyHashSlot(strKey.data(), strKey.size())) {}
+    CRedisKey(const char *pszKey) : m_strKey(pszKey), m_nSlot(KeyHashSlot(m_strKey.data(), m_strKey.size())) {}
+    CRedisKey(const std::string &strKey, uint32_t nSlot) : m_strKey(strKey), m_nSlot(nSlot) {}
+
+    const std::string & Str() const { return m_strKey; }
+    uint32_t Slot() const { return m_nSlot; }
+    operator const std::string &() const { return m_strKey; }
+
+private:
+    std::string m_strKey;
+    uint32_t m_nSlot;
+};
+
+#define REDIS_KEY(key)      CRedisKey(key, std::integral_constant<uint32_t, HASH_SLOT_CONST(key)>::value)
+
+// a cluster node as reported by CLUSTER SHARDS, CLUSTER SLOTS leaves the health and the offset unknown
+struct RedisNode
+{
+    std::string strId;
+    std::string strHost;        // the endpoint the client connects to
+    std::string strIp;
+    std::string strHostname;
+    int nPort;
+    int nTlsPort;
+    bool bMaster;
+    std::string strHealth;      // online, failed, loading or empty when unknown
+    long long nReplOffset;
+};
+
 class CRedisServer;
 struct SlotRegion
 {
@@ -119,6 +287,396 @@ struct SlotRegion
     std::string strHost;
     int nPort;
     CRedisServer *pRedisServ;
+    std::vector<std::pair<std::string, int> > vecSlave;     // replicas fit for reads
+    CRedisServer *pSlaveServ;
+    std::string strNodeId;                                  // id of the master, empty when unknown
+    std::vector<RedisNode> vecNode;                         // every node of the shard, master first
+};
+
+// absolute deadline of one call, it caps the pool wait, the socket I/O, redirects and refresh waits
+class CDeadline
+{
+public:
+	CDeadline() : m_tmDeadline(std::chrono::steady_clock::time_point::max()) {}
+	explicit CDeadline(std::chrono::steady_clock::time_point tmDeadline) : m_tmDeadline(tmDeadline) {}
+	static CDeadline After(int nMilliSec) { return CDeadline(std::chrono::steady_clock::now() + std::chrono::milliseconds(nMilliSec)); }
+
+	bool IsSet() const { return m_tmDeadline != std::chrono::steady_clock::time_point::max(); }
+	bool Expired() const { return IsSet() && std::chrono::steady_clock::now() >= m_tmDeadline; }
+	// -1 without a deadline
+	int RemainMs() const
+	{
+		if (!IsSet())
+			return -1;
+		auto nRemain = std::chrono::duration_cast<std::chrono::milliseconds>(m_tmDeadline - std::chrono::steady_clock::now()).count();
+		return nRemain > 0 ? static_cast<int>(nRemain) : 0;
+	}
+	// nDefaultMs capped by the deadline
+	int CapMs(int nDefaultMs) const { return IsSet() ? std::min(nDefaultMs, RemainMs()) : nDefaultMs; }
+
+private:
+	std::chrono::steady_clock::time_point m_tmDeadline;
+};
+
+// priority of the commands the current thread sends while the scope lives, PRIO_NORMAL outside any.
+// e.g. CRedisPriority prioBulk(PRIO_BULK) at the top of a batch job
+class CRedisPriority
+{
+public:
+	explicit CRedisPriority(int nPriority) : m_nPrev(s_nCurrent) { s_nCurrent = nPriority; }
+	~CRedisPriority() { s_nCurrent = m_nPrev; }
+	static int Current() { return s_nCurrent; }
+
+private:
+	int m_nPrev;
+	static thread_local int s_nCurrent;
+};
+
+// client-wide retry budget: each request earns dRatio of a retry, a retry spends one,
+// nMinRetry is the initial balance and the cap is ten times that
+class CRetryBudget
+{
+public:
+	CRetryBudget() : m_nRatio(0), m_nMax(0), m_nBalance(0) {}
+	void Reset(double dRatio, int nMinRetry);
+	void Deposit();
+	bool Withdraw();
+
+private:
+	int64_t m_nRatio;		// thousandths of a retry earned per request, 0 leaves retries unlimited
+	int64_t m_nMax;
+	std::atomic<int64_t> m_nBalance;
+};
+
+// socket timeouts in milliseconds, -1 takes the client timeout. a read or write timeout of 0 or below also
+// takes the client timeout, a blocked socket never waits forever
+struct RedisTimeout
+{
+    int nConnectMs;
+    int nReadMs;
+    int nWriteMs;
+    RedisTimeout(int nConnect = -1, int nRead = -1, int nWrite = -1) : nConnectMs(nConnect), nReadMs(nRead), nWriteMs(nWrite) {}
+};
+
+// socket options applied on every connect, 0 (-1 for the keep-alive and IP_TOS) keeps the system default.
+// the TCP ones are skipped on unix sockets
+struct RedisSocketOpt
+{
+    bool bNoDelay;          // TCP_NODELAY, on by default like in hiredis
+    int nKeepAliveSec;      // SO_KEEPALIVE probe interval, -1 the hiredis default, 0 off
+    int nSendBuf;           // SO_SNDBUF bytes
+    int nRecvBuf;           // SO_RCVBUF bytes
+    int nBusyPollUs;        // SO_BUSY_POLL microseconds, linux only
+    int nTos;               // IP_TOS
+    bool bUring;            // blocking requests over io_uring (linux 6.0 and later), plain sockets where it is missing
+    int nZeroCopyMin;       // commands of at least this many bytes go out with MSG_ZEROCOPY, 0 off. tcp without
+                            // bUring, linux 4.14 and later
+    RedisSocketOpt() : bNoDelay(true), nKeepAliveSec(-1), nSendBuf(0), nRecvBuf(0), nBusyPollUs(0), nTos(-1), bUring(false),
+                       nZeroCopyMin(0) {}
+};
+
+// commands every new connection sends before it joins the pool, pipelined in one round trip
+struct RedisHandshake
+{
+    std::string strUser;                    // ACL user, empty for the default user
+    std::string strPassword;                // AUTH is skipped when empty
+    int nDb;                                // SELECT when above 0, standalone and shard mode only
+    std::string strClientName;              // CLIENT SETNAME
+    bool bHello;                            // send AUTH and SETNAME as one HELLO 2 (redis 6 and later)
+    std::vector<std::string> vecCommand;    // further commands, arguments separated by spaces
+    RedisHandshake() : nDb(0), bHello(false) {}
+};
+
+// bounds of the commands in flight, blocking and async alike, 0 is unlimited. a node limit holds for every
+// master and replica on its own, a client limit for all of them together
+struct RedisLimit
+{
+    int nNodeNum;           // commands in flight per node
+    int64_t nNodeBytes;     // command bytes in flight per node
+    int nClientNum;
+    int64_t nClientBytes;
+    int nMode;              // LIMIT_BLOCK, LIMIT_FAIL or LIMIT_SHED when a limit is reached
+    int nWaitMs;            // longest wait of a request without deadline
+    int nHighReserve;       // pooled connections per node only PRIO_HIGH requests may take, at most the pool size minus one
+    int nBulkConn;          // most pooled connections per node lent to PRIO_BULK requests at once, 0 no cap
+    RedisLimit() : nNodeNum(0), nNodeBytes(0), nClientNum(0), nClientBytes(0), nMode(LIMIT_BLOCK), nWaitMs(1000),
+                   nHighReserve(0), nBulkConn(0) {}
+};
+
+struct RedisStat
+{
+    int64_t nInitMs;        // duration of the last Initialize
+    int64_t nSlotLoadMs;    // duration of the last slot map load, connecting new nodes included
+    int nServNum;           // master nodes in use
+    int nConnNum;           // connections opened to the master nodes
+    int nIdleConn;          // of which idle in the pools
+    int nMaxConn;           // pool bound summed over the master nodes
+    int nPeakConn;          // highest nConnNum summed over the master nodes
+    int64_t nGrowNum;       // connections opened on demand after Initialize
+    int64_t nShrinkNum;     // idle connections closed by the sweeper
+    int64_t nWaitNum;       // requests which found a full pool and waited for a connection
+    int64_t nExhaustNum;    // of which got none in time
+    int nUringConn;         // connections running on io_uring
+    int64_t nZeroCopySend;  // commands sent with MSG_ZEROCOPY
+    int64_t nZeroCopyCopied;    // connections which turned it off because the kernel copied anyway
+    int nDownNum;           // master nodes left to the reconnector
+    int nBulkConn;          // pooled connections lent to PRIO_BULK requests
+    int nInFlight;          // commands in flight under the client limit (counted only when it is set)
+    int64_t nLimitNum;      // requests which found a node or client limit reached
+    int64_t nRejectNum;     // of which got no room, shed or timed out
+};
+
+// admission of the commands in flight against a count and a byte limit. shared by the async callbacks,
+// which may outlive the node it belongs to
+class CInFlight
+{
+public:
+	CInFlight() : m_nMaxNum(0), m_nMaxBytes(0), m_nNum(0), m_nBytes(0), m_nLimitNum(0), m_nRejectNum(0) {}
+	void Reset(int nMaxNum, int64_t nMaxBytes) { m_nMaxNum = nMaxNum; m_nMaxBytes = nMaxBytes; }
+	bool IsLimited() const { return m_nMaxNum > 0 || m_nMaxBytes > 0; }
+	// room for one command of nBytes, waiting up to nWaitMs while full. a command above the byte
+	// limit gets in once nothing else is in flight
+	bool Acquire(int64_t nBytes, int nWaitMs);
+	void Release(int64_t nBytes);
+	void AddStat(RedisStat *pStat, bool bInFlight);
+
+private:
+	int m_nMaxNum;
+	int64_t m_nMaxBytes;
+	std::mutex m_mutexFlight;
+	std::condition_variable m_condFlight;
+	int m_nNum;
+	int64_t m_nBytes;
+	int64_t m_nLimitNum;
+	int64_t m_nRejectNum;
+};
+
+// reply of one node to a fan-out command
+struct NodeReply
+{
+    std::string strHost;
+    int nPort;
+    int nRet;
+    std::string strVal;                 // string and status replies, the message of error replies
+    long nVal;                          // integer replies
+    std::vector<std::string> vecVal;    // array replies
+};
+
+// fixed size worker pool for requests which should not block the caller (hedged reads)
+class CTaskPool
+{
+public:
+	CTaskPool() : m_bExit(false) {}
+	~CTaskPool() { Stop(); }
+
+	// the workers may only run on vecCpu when it is not empty
+	void Start(int nThreads, const std::vector<int> &vecCpu = std::vector<int>());
+	void Stop();
+	bool Submit(std::function<void()> funcTask);
+	bool IsRunning() const { return !m_vecThread.empty(); }
+
+private:
+	void Run();
+
+private:
+	std::vector<std::thread> m_vecThread;
+	std::queue<std::function<void()> > m_queTask;
+	std::mutex m_mutexTask;
+	std::condition_variable m_condTask;
+	bool m_bExit;
+	std::vector<int> m_vecCpu;
+};
+
+// sliding window of request latencies (microseconds) used to derive the hedge delay
+class CLatencyWindow
+{
+public:
+	CLatencyWindow() : m_nNext(0), m_nCount(0), m_nCached(-1) { m_vecSample.resize(HEDGE_WINDOW_SIZE, 0); }
+
+	void Record(int64_t nMicros);
+	int64_t Percentile(double dRatio);
+
+private:
+	std::vector<int64_t> m_vecSample;
+	size_t m_nNext;
+	size_t m_nCount;
+	int64_t m_nCached;
+	std::mutex m_mutexSample;
+};
+
+// completion of an engine request on its loop thread: the RC_* code and the reply (null on a
+// failed request), which the engine frees once the callback returns
+typedef std::function<void (int, redisReply *)> TFuncDone;
+
+struct redisAsyncContext;
+class CRedisLoop;
+
+struct LoopRqst
+{
+	std::atomic<LoopRqst *> pNext;
+	std::string strHost;
+	int nPort;
+	std::vector<std::string> vecArg;
+	TFuncDone funcDone;
+	LoopRqst() : pNext(nullptr), nPort(0) {}
+};
+
+// non-blocking connection of one loop to one node
+struct LoopConn
+{
+	CRedisLoop *pLoop;
+	redisAsyncContext *pAsync;
+	std::string strKey;
+	uint32_t nEvents;				// epoll events registered for the socket
+	bool bConnected;
+	bool bClosed;
+	bool bTimedOut;
+	std::queue<int64_t> queSend;	// steady clock ms of the commands waiting for their reply
+	LoopConn() : pLoop(nullptr), pAsync(nullptr), nEvents(0), bConnected(false), bClosed(false), bTimedOut(false) {}
+};
+
+// event loop thread of the I/O engine: multiplexes its own connections with epoll and takes requests
+// from any thread through a lock-free MPSC queue, an eventfd wakes it only when it sleeps. linux only
+class CRedisLoop
+{
+public:
+	CRedisLoop(int nConnectMs, int nReadMs, const RedisHandshake &redisHandshake, const RedisSocketOpt &socketOpt,
+		const std::function<void ()> &funcMoved);
+	~CRedisLoop();
+
+	// nCpu pins the loop thread to one cpu, -1 leaves it to the scheduler
+	bool Start(int nCpu = -1);
+	void Stop();
+	void Submit(LoopRqst *pRqst);
+
+	// hiredis event hooks
+	void UpdateEvent(LoopConn *pConn, uint32_t nEvents);
+	void CloseConn(LoopConn *pConn);
+	void OnReply(LoopConn *pConn, LoopRqst *pRqst, redisReply *pReply);
+
+private:
+	void Run();
+	LoopRqst *Pop();
+	void Dispatch(LoopRqst *pRqst);
+	LoopConn *Connect(const std::string &strHost, int nPort);
+	bool Send(LoopConn *pConn, const std::vector<std::string> &vecArg, bool bHandshake, void *pPriv);
+	void CheckTimeout(int64_t nNowMs);
+
+private:
+	int m_nEpoll;
+	int m_nEvent;
+	int m_nCpu;
+	std::thread m_thread;
+	std::atomic<bool> m_bExit;
+	std::atomic<bool> m_bSleeping;
+
+	std::atomic<LoopRqst *> m_pHead;	// producers push here
+	LoopRqst *m_pTail;					// the loop pops here
+	LoopRqst m_stub;
+
+	int m_nConnectTimeout;
+	int m_nReadTimeout;
+	RedisHandshake m_redisHandshake;
+	RedisSocketOpt m_socketOpt;
+	std::function<void ()> m_funcMoved;
+	std::map<std::string, LoopConn *> m_mapConn;
+	std::vector<LoopConn *> m_vecDead;
+};
+
+class CRedisEngine
+{
+public:
+	CRedisEngine() {}
+	~CRedisEngine() { Stop(); }
+
+	// loop i is pinned to vecCpu[i % size], nLoopNum 0 starts one loop per cpu of vecCpu. the nodes are
+	// sharded over the loops, each loop owns the connections of its nodes
+	bool Start(int nLoopNum, int nConnectMs, int nReadMs, const RedisHandshake &redisHandshake,
+		const RedisSocketOpt &socketOpt, const std::function<void ()> &funcMoved,
+		const std::vector<int> &vecCpu = std::vector<int>());
+	void Stop();
+	bool IsRunning() const { return !m_vecLoop.empty(); }
+	int Submit(const std::string &strHost, int nPort, const std::vector<std::string> &vecArg, const TFuncDone &funcDone);
+
+private:
+	std::vector<CRedisLoop *> m_vecLoop;
+};
+
+// io_uring transport of one blocking connection: a multishot receive into a registered buffer ring
+// stays armed between requests, so a request costs a single io_uring_enter which submits the send
+// and reaps its reply. linux 6.0 and later, Init fails on a kernel without multishot receive
+class CUringRing
+{
+public:
+	CUringRing();
+	~CUringRing();
+
+	bool Init(int nFd);
+	void SetTimeout(int nTimeoutMs) { m_nTimeout = nTimeoutMs; }
+	// sends nLen bytes of pszCmd (nothing when 0) and waits for one reply. failures are reported
+	// through the context error like a plain socket would
+	int Request(redisContext *pContext, const char *pszCmd, size_t nLen, redisReply **ppReply);
+
+private:
+	void QueueSend();
+	void QueueRecv();
+	bool SetupBuffer();
+	bool GrowBuffer();
+	void RecycleBuffer(uint16_t nBid);
+	int Reap(redisContext *pContext);
+	int Fail(redisContext *pContext, int nErr, int nErrno, const char *pszMsg);
+
+private:
+	int m_nRing;
+	int m_nFd;
+	void *m_pRing;
+	size_t m_nRingSize;
+	void *m_pSqes;
+	size_t m_nSqeSize;
+	unsigned *m_pSqHead;
+	unsigned *m_pSqTail;
+	unsigned *m_pSqMask;
+	unsigned *m_pSqArray;
+	unsigned *m_pCqHead;
+	unsigned *m_pCqTail;
+	unsigned *m_pCqMask;
+	void *m_pCqes;
+	void *m_pBufRing;
+	char *m_pBufMem;
+	uint16_t m_nBufNum;
+	uint16_t m_nBufTail;
+	bool m_bRecvArmed;
+	int m_nInFlight;
+	std::string m_strSend;		// owned by the ring until the kernel has sent it
+	size_t m_nSendOff;
+	int m_nTimeout;
+};
+
+// MSG_ZEROCOPY sender of one blocking connection: the formatted command stays with the connection until
+// the completion on the socket error queue says the kernel released its pages. linux 4.14 and later
+class CZeroCopy
+{
+public:
+	CZeroCopy();
+	~CZeroCopy();
+
+	bool Init(int nFd, int nMinSize, std::atomic<int64_t> *pnSend, std::atomic<int64_t> *pnCopied);
+	size_t MinSize() const { return m_nMinSize; }
+	// sends nLen bytes of pszCmd and takes it over, it is freed with redisFreeCommand once released.
+	// failures are reported through the context error like a plain socket would
+	int Send(redisContext *pContext, char *pszCmd, int nLen);
+	// frees the buffers the kernel is done with, waits up to nWaitMs for the others
+	void Reap(int nWaitMs);
+
+private:
+	int m_nFd;
+	size_t m_nMinSize;
+	uint32_t m_nNextId;		// completion id of the next zerocopy send
+	uint32_t m_nDoneId;		// every id below has completed
+	bool m_bCopied;			// the kernel copied anyway (loopback, no scatter-gather), later sends copy too
+	std::queue<std::pair<uint32_t, char *> > m_queBuffer;	// buffers with the id after their last send
+	std::atomic<int64_t> *m_pnSend;
+	std::atomic<int64_t> *m_pnCopied;
 };
 
 class CRedisCommand
@@ -137,6 +695,15 @@ public:
 
     void SetSlot(int nSlot) { m_nSlot = nSlot; }
     void SetConvFunc(TFuncConvert funcConv) { m_funcConv = funcConv; }
+    // read and write timeout of this command only, -1 keeps the one of the connection
+    void SetTimeout(int nTimeoutMs) { m_nTimeout = nTimeoutMs; }
+    int GetTimeout() const { return m_nTimeout; }
+    size_t GetSize() const { return m_strCmd.size(); }
+    // PRIO_*, the thread's CRedisPriority when the command is created
+    void SetPriority(int nPriority) { m_nPriority = nPriority; }
+    int GetPriority() const { return m_nPriority; }
+    void SetDeadline(const CDeadline &deadline) { m_deadline = deadline; }
+    const CDeadline &GetDeadline() const { return m_deadline; }
 
     void SetArgs();
     void SetArgs(const std::string &strArg);
@@ -153,9 +720,9 @@ public:
     void SetArgs(const std::string &strArg1, const std::vector<std::string> &vecArg2, const std::vector<std::string> &vecArg3);
     void SetArgs(const std::string &strArg1, const std::string &strArg2, const std::string &strArg3, const std::string &strArg4);
 
-    int CmdRequest(redisContext *pContext);
+    int CmdRequest(redisContext *pContext, CUringRing *pUring = nullptr, CZeroCopy *pZeroCopy = nullptr);
     int CmdAppend(redisContext *pContext);
-    int CmdReply(redisContext *pContext);
+    int CmdReply(redisContext *pContext, CUringRing *pUring = nullptr);
     int FetchResult(const TFuncFetch &funcFetch);
 
 private:
@@ -173,27 +740,46 @@ protected:
     redisReply *m_pReply;
 
     int m_nSlot;
+    int m_nTimeout;
+    int m_nPriority;
+    CDeadline m_deadline;
     TFuncConvert m_funcConv;
 };
 
 class CRedisServer;
 class CRedisConnection
 {
+    friend class CRedisServer;
 public:
     CRedisConnection(CRedisServer *pRedisServ);
     ~CRedisConnection();
     bool IsValid() { return m_pContext != nullptr; }
     int ConnRequest(CRedisCommand *pRedisCmd);
     int ConnRequest(std::vector<CRedisCommand *> &vecRedisCmd);
+    // timeouts of the requests made while the connection is attached, -1 restores the server ones
+    void SetTimeout(int nReadMs, int nWriteMs);
+    bool Ping();
+    int64_t GetUseTime() const { return m_nUseTime; }
 
 private:
     bool ConnectToRedis(const std::string &strHost, int nPort, int nTimeout);
     bool Reconnect();
+    bool EnsureContext();
+    bool Handshake();
+    void ApplyTimeout(int nReadMs, int nWriteMs);
+    bool CheckBroken();
+    void CloseContext();
 
 private:
     redisContext *m_pContext;
-    time_t m_nUseTime;
+    int64_t m_nUseTime;		// steady clock ms of the last request
     CRedisServer *m_pRedisServ;
+    int m_nReadTimeout;
+    int m_nWriteTimeout;
+    int m_arrApplied[2];	// read and write timeouts set on the socket, -1 before the first ApplyTimeout
+    CUringRing *m_pUring;
+    CZeroCopy *m_pZeroCopy;
+    int m_nPriority;		// lane the pool lent the connection to, -1 while it is not lent
 };
 
 class CRedisServer
@@ -201,14 +787,24 @@ class CRedisServer
     friend class CRedisConnection;
     friend class CRedisClient;
 public:
-    CRedisServer(const std::string &strHost, int nPort, int nClientTimeout, int nServerTimeout,int nConnNum);
+    CRedisServer(const std::string &strHost, int nPort, int nClientTimeout, int nServerTimeout, int nConnNum,
+                 bool bReadOnly = false, int nMinIdle = -1, const RedisTimeout &redisTimeout = RedisTimeout(),
+                 const RedisHandshake &redisHandshake = RedisHandshake(), const RedisSocketOpt &socketOpt = RedisSocketOpt(),
+                 const RedisLimit &redisLimit = RedisLimit(), const std::shared_ptr<CInFlight> &pClientFlight = nullptr);
     virtual ~CRedisServer();
 
     void SetSlave(const std::string &strHost, int nPort);
 
-    std::string GetHost() const { return m_strHost; }
-    int GetPort() const { return m_nPort; }
-	bool IsValid() const { return m_queIdleConn.size() > 0 ? true : false; }
+    // the reconnector may move a standalone server to one of its replicas, so the address is read under m_mutexHost
+    std::string GetHost() const;
+    int GetPort() const;
+    std::vector<std::pair<std::string, int> > GetHosts() const;
+    const std::string &GetNodeId() const { return m_strNodeId; }
+	bool IsValid() const { return m_nConnCount > 0; }
+	// a failed connect hands the node to the reconnector, requests fail fast until it is back
+	bool IsDown() const { return m_bDown; }
+	int GetConnCount() const { return m_nConnCount; }
+	void AddStat(RedisStat *pStat);
 
     // for the blocking request
     int ServRequest(CRedisCommand *pRedisCmd);
@@ -216,19 +812,55 @@ public:
 
 private:
     bool Initialize();
-    CRedisConnection *FetchConnection();
+    // a request without the in-flight admission, for the client's own control-plane commands
+    int PoolRequest(CRedisCommand *pRedisCmd);
+    CRedisConnection *FetchConnection(int nWaitMs = 0, int nPriority = PRIO_NORMAL);
     void ReturnConnection(CRedisConnection *pRedisConn);
+    bool LaneFree(int nPriority) const;
     void CleanConn();
+    // for a pool which has been replaced: closes the idle connections and every one handed back later
+    void Retire();
+    void KeepAlive(int64_t nNowMs, int nPingIdleMs, int nEvictIdleMs);
+    void MarkDown();
+    void BeginBackoff();
+    int64_t Probe(int64_t nNowMs);
 
 private:
 	std::string m_strHost;
 	int m_nPort;
+	std::string m_strNodeId;
 	int m_nCliTimeout;
 	int m_nSerTimeout;
+	int m_nConnectTimeout;	// ms
+	int m_nReadTimeout;
+	int m_nWriteTimeout;
 	int m_nConnNum;
+	bool m_bReadOnly;
+	int m_nMinIdle;
+	RedisHandshake m_redisHandshake;
+	RedisSocketOpt m_socketOpt;
+	RedisLimit m_redisLimit;
+	std::shared_ptr<CInFlight> m_pInFlight;		// of this node
+	std::shared_ptr<CInFlight> m_pClientFlight;
 
     std::queue<CRedisConnection *> m_queIdleConn;
-    std::vector<std::pair<std::string, int> > m_vecHosts;
+    std::atomic<int> m_nConnCount;
+    int m_nConnPeak;
+    int m_arrBusy[PRIO_NUM];	// connections lent out per priority, guarded by m_mutexConn
+    int m_arrWait[PRIO_NUM];	// requests waiting for a connection per priority
+    std::atomic<int64_t> m_nGrowNum;
+    std::atomic<int64_t> m_nShrinkNum;
+    std::atomic<int64_t> m_nWaitNum;
+    std::atomic<int64_t> m_nExhaustNum;
+    std::atomic<bool> m_bDown;
+    std::atomic<int> m_nUringConn;
+    std::atomic<int64_t> m_nZeroCopySend;
+    std::atomic<int64_t> m_nZeroCopyCopied;
+    bool m_bRetired;		// guarded by m_mutexConn
+    int m_nBackoffMs;		// current reconnect backoff, guarded by m_mutexConn
+    int64_t m_nProbeTime;	// steady clock ms of the next reconnect attempt
+    std::vector<std::pair<std::string, int> > m_vecHosts;	// the address first, then replicas of a standalone master
+    mutable std::mutex m_mutexHost;		// guards m_strHost, m_nPort and m_vecHosts
     std::mutex m_mutexConn;
 	std::condition_variable _wait;
 };
@@ -239,22 +871,84 @@ public:
 	CRedisClient();
 	~CRedisClient();
 
+	// strHost may be "unix:///path/redis.sock" for a local instance, nPort is then ignored
 	bool Initialize(const std::string &strHost, int nPort, int nClientTimeout, int nServerTimeout, int nConnNum);
+	// standalone master discovered through sentinels ("host:port" each), the client follows +switch-master
+	bool InitializeSentinel(const std::vector<std::string> &vecSentinel, const std::string &strMasterName,
+		int nClientTimeout, int nServerTimeout, int nConnNum);
+	// standalone instances ("host:port" or "unix:///path" each) sharded by a consistent hash ring over the key slots,
+	// hash tags keep related keys on one node and a changed node list moves about 1/N of the keys. fails only
+	// when no shard is reachable, an unreachable one stays in the ring and its keys fail until it is back
+	bool InitializeShard(const std::vector<std::string> &vecHost, int nClientTimeout, int nServerTimeout, int nConnNum);
 	bool IsCluster() { return m_bCluster; }
+	bool IsShard() { return m_bShard; }
 
 	CRedisConnection* AttachConnection(int slot);
 	void DetachConnection(int slot, CRedisConnection* connection);
 	uint32_t HASH_SLOT(const std::string &strKey);
+	void HASH_SLOT(const std::vector<std::string> &vecKey, std::vector<uint32_t> *pvecSlot);
+
+	// hedged reads: if the master has not answered after the dPercentile latency (at least nMinDelayMs),
+	// the same read is sent to a replica and the first reply wins. the master is read on the calling thread,
+	// the nWorkers only send hedges and at most dBudget of the reads get one. call before Initialize.
+	void SetHedgedRead(bool bEnable, double dPercentile = 0.99, int nMinDelayMs = 2, int nWorkers = 8, double dBudget = 0.1);
+	// Get without a connection reads from a replica, falling back to the master. call before Initialize.
+	void SetReplicaRead(bool bEnable) { m_bReplicaRead = bEnable; }
+	// cluster mode: reload the slot map every nIntervalMs plus up to nJitterMs (0 disables), asking
+	// nSeedNum nodes in parallel and keeping the view most of them agree on. call before Initialize.
+	void SetTopologyRefresh(int nIntervalMs, int nJitterMs = 0, int nSeedNum = 3);
+	// open only nMinIdle connections per node at startup, the rest up to nConnNum on first use and
+	// never shrink the pool below it. -1 opens the whole pool eagerly. call before Initialize.
+	void SetMinIdleConn(int nMinIdle) { m_nMinIdle = nMinIdle; }
+	// cluster mode: keep the last slot map in strPath and start from it without asking the seed node,
+	// the map is corrected by MOVED replies and the periodic refresh. call before Initialize.
+	void SetTopologySnapshot(const std::string &strPath) { m_strSnapshot = strPath; }
+	// connect, read and write timeouts in milliseconds of every connection, a connection which timed out
+	// is closed instead of going back to the pool. -1 keeps nClientTimeout. call before Initialize.
+	void SetTimeout(int nConnectMs, int nReadMs, int nWriteMs) { m_redisTimeout = RedisTimeout(nConnectMs, nReadMs, nWriteMs); }
+	// AUTH, SELECT, CLIENT SETNAME and custom commands run on every new connection, a failing
+	// reply fails the connect. call before Initialize.
+	void SetHandshake(const RedisHandshake &redisHandshake) { m_redisHandshake = redisHandshake; }
+	// socket options of every connection, applied again on each reconnect. call before Initialize.
+	void SetSocketOpt(const RedisSocketOpt &socketOpt) { m_socketOpt = socketOpt; }
+	// in-flight limits per node and per client, with the behavior when one is reached. call before Initialize.
+	void SetLimit(const RedisLimit &redisLimit);
+	// cpus the library threads (refresh, sweeper, reconnector, sentinel watcher, hedge workers) may run
+	// on, the I/O engine loops get one cpu each in turn. empty leaves them to the scheduler. the threads
+	// pin themselves before they allocate, so their buffers are local to the node of those cpus.
+	// call before Initialize and StartEngine, linux only
+	void SetAffinity(const std::vector<int> &vecCpu) { m_vecCpu = vecCpu; }
+	// cpus of the numa node the network interface strIfName (e.g. "eth0") is attached to, empty when
+	// unknown. linux only
+	static std::vector<int> NicCpus(const std::string &strIfName);
+	// retries after a redirect or a broken node are limited to dRatio of the requests (plus nMinRetry),
+	// dRatio 0 leaves them unlimited
+	void SetRetryBudget(double dRatio, int nMinRetry = 10) { m_retryBudget.Reset(dRatio, nMinRetry); }
+	// a background sweeper PINGs pooled connections idle for nPingIdleMs (-1: half the server timeout,
+	// 0: off) and closes those idle for nEvictIdleMs (0: never) down to the SetMinIdleConn floor.
+	// call before Initialize.
+	void SetKeepAlive(int nPingIdleMs, int nEvictIdleMs = 0) { m_nPingIdle = nPingIdleMs; m_nEvictIdle = nEvictIdleMs; }
+	void GetStat(RedisStat *pStat);
+	// cluster mode: every node of the current slot map, masters first
+	int GetTopology(std::vector<RedisNode> *pvecNode);
+	// I/O engine of nLoopNum epoll loops (0: one per core, or per SetAffinity cpu) serving AsyncCommand, each loop keeps its own
+	// connection to the nodes it is asked for. call after Initialize, linux only
+	bool StartEngine(int nLoopNum = 0);
+	// queues vecArg (the command and its arguments) for the node of redisKey without waiting. funcDone
+	// runs on a loop thread and must not block, a MOVED reply also triggers a slot map refresh. with SetLimit
+	// a full node or client blocks the caller under LIMIT_BLOCK, except when called from funcDone: the
+	// loop thread never waits and gets RC_NO_RESOURCE instead
+	int AsyncCommand(const CRedisKey &redisKey, const std::vector<std::string> &vecArg, const TFuncDone &funcDone);
 
 	/* interfaces for generic */
 	//int Del(const std::string &strKey, long *pnVal = nullptr);
-	int Del(CRedisConnection* connection, const std::string &strKey, OUT RedisResult* result);
+	int Del(CRedisConnection* connection, const CRedisKey &redisKey, OUT RedisResult* result, const CDeadline &deadline = CDeadline());
 	//int Dump(const std::string &strKey, std::string *pstrVal);
 	//int Exists(const std::string &strKey, long *pnVal);
 	//int Expire(const std::string &strKey, long nSec, long *pnVal = nullptr);
-	int Expire(CRedisConnection* connection, const std::string &strKey, long nSec, long *pnVal = nullptr);
+	int Expire(CRedisConnection* connection, const CRedisKey &redisKey, long nSec, long *pnVal = nullptr, const CDeadline &deadline = CDeadline());
 	//int Expireat(const std::string &strKey, long nTime, long *pnVal = nullptr);
-	//int Keys(const std::string &strPattern, std::vector<std::string> *pvecVal);
+	int Keys(const std::string &strPattern, std::vector<std::string> *pvecVal, const CDeadline &deadline = CDeadline());
 	//int Persist(const std::string &strKey, long *pnVal = nullptr);
 	//int Pexpire(const std::string &strKey, long nMilliSec, long *pnVal = nullptr);
 	//int Pexpireat(const std::string &strKey, long nMilliTime, long *pnVal = nullptr);
@@ -276,24 +970,25 @@ public:
 	//int Bitpos(const std::string &strKey, long nBitVal, long nStart, long nEnd, long *pnVal);
 	//int Decr(const std::string &strKey, long *pnVal = nullptr);
 	//int Decrby(const std::string &strKey, long nDecr, long *pnVal = nullptr);
-	//int Get(const std::string &strKey, std::string *pstrVal);
-	int Get(CRedisConnection* connection, const std::string &strKey, std::string *pstrVal);
+	int Get(const CRedisKey &redisKey, std::string *pstrVal, const CDeadline &deadline = CDeadline());
+	int Get(CRedisConnection* connection, const CRedisKey &redisKey, std::string *pstrVal, const CDeadline &deadline = CDeadline());
 	//int Getbit(const std::string &strKey, long nOffset, long *pnVal);
 	//int Getrange(const std::string &strKey, long nStart, long nEnd, std::string *pstrVal);
 	//int Getset(const std::string &strKey, std::string *pstrVal);
 	//int Incr(const std::string &strKey, long *pnVal);
 	//int Incrby(const std::string &strKey, long nIncr, long *pnVal);
 	//int Incrbyfloat(const std::string &strKey, double dIncr, double *pdVal);
-	//int Mget(const std::vector<std::string> &vecKey, std::vector<std::string> *pvecVal);
+	// keys are grouped per node (and per slot in cluster mode) and the groups are fetched concurrently
+	int Mget(const std::vector<std::string> &vecKey, std::vector<std::string> *pvecVal, const CDeadline &deadline = CDeadline());
 	//int Mset(const std::vector<std::string> &vecKey, const std::vector<std::string> &vecVal);
 	//int Psetex(const std::string &strKey, long nMilliSec, const std::string &strVal);
 	//int Set(const std::string &strKey, const std::string &strVal, unsigned int expired = 0);
-	int Set(CRedisConnection* connection, const std::string &strKey, const std::string &strVal, unsigned int expired = 0);
+	int Set(CRedisConnection* connection, const CRedisKey &redisKey, const std::string &strVal, unsigned int expired = 0, const CDeadline &deadline = CDeadline());
 	//int Setbit(const std::string &strKey, long nOffset, bool bVal);
 	//int Setex(const std::string &strKey, long nSec, const std::string &strVal);
-	int Setex(CRedisConnection* connection, const std::string &strKey, long nSec, const std::string &strVal);
+	int Setex(CRedisConnection* connection, const CRedisKey &redisKey, long nSec, const std::string &strVal, const CDeadline &deadline = CDeadline());
 	//int Setnx(const std::string &strKey, const std::string &strVal);
-	int Setnx(CRedisConnection* connection, const std::string &strKey, const std::string &strVal);
+	int Setnx(CRedisConnection* connection, const CRedisKey &redisKey, const std::string &strVal, const CDeadline &deadline = CDeadline());
 	//int Setrange(const std::string &strKey, long nOffset, const std::string &strVal, long *pnVal = nullptr);
 	//int Strlen(const std::string &strKey, long *pnVal);
 
@@ -375,38 +1070,71 @@ public:
 
 	/* interfaces for system */
 	//int Time(struct timeval *ptmVal);
+	int Dbsize(long *pnVal, const CDeadline &deadline = CDeadline());
+
+	/* interfaces for fan-out, the command is sent to every master (and replica with bAllNodes) concurrently.
+	   returns RC_SUCCESS when all nodes answered, RC_PART_SUCCESS when some did */
+	int FanOut(const std::string &strCmd, std::vector<NodeReply> *pvecReply, bool bAllNodes = false, const CDeadline &deadline = CDeadline());
+	static long SumReply(const std::vector<NodeReply> &vecReply);
+	static void ConcatReply(const std::vector<NodeReply> &vecReply, std::vector<std::string> *pvecVal);
+	// field/value union of INFO text or CONFIG GET pairs, the first node reporting a field wins
+	static void MergeReply(const std::vector<NodeReply> &vecReply, std::map<std::string, std::string> *pmapVal);
 
 	/* interface for transaction */
-	int Watch(CRedisConnection* connection, const std::string &strKey);
-	int Multi(CRedisConnection* connection, const std::string &strKey);
-	int Exec(CRedisConnection* connection, const std::string &strKey, OUT RedisResult* result);
-	int Unwatch(CRedisConnection* connection, const std::string &strKey);
-	int Discard(CRedisConnection* connection, const std::string &strKey);
+	int Watch(CRedisConnection* connection, const CRedisKey &redisKey, const CDeadline &deadline = CDeadline());
+	int Multi(CRedisConnection* connection, const CRedisKey &redisKey, const CDeadline &deadline = CDeadline());
+	int Exec(CRedisConnection* connection, const CRedisKey &redisKey, OUT RedisResult* result, const CDeadline &deadline = CDeadline());
+	int Unwatch(CRedisConnection* connection, const CRedisKey &redisKey, const CDeadline &deadline = CDeadline());
+	int Discard(CRedisConnection* connection, const CRedisKey &redisKey, const CDeadline &deadline = CDeadline());
 
 private:
 	static bool ConvertToMapInfo(const std::string &strVal, std::map<std::string, std::string> &mapVal);
 	static bool GetValue(redisReply *pReply, std::string &strVal);
 	static bool GetArray(redisReply *pReply, std::vector<std::string> &vecVal);
 	static CRedisServer * FindServer(const std::vector<CRedisServer *> *vecRedisServ, const std::string &strHost, int nPort);
+	static CRedisServer * FindServer(const std::vector<CRedisServer *> *vecRedisServ, const std::string &strNodeId,
+		const std::string &strHost, int nPort);
 
     void operator()();
+    bool StartWorker();
+    void SweepConnection();
+    void ReconnectServer();
     void CleanServer();
 	void CleanOldServer();
+	// the handshake of a new node connection, a redis cluster node refuses SELECT
+	RedisHandshake NodeHandshake() const;
     CRedisServer * FindServer(int nSlot) const;
     bool InSameNode(const std::string &strKey1, const std::string &strKey2);
     CRedisServer * GetMatchedServer(const CRedisCommand *pRedisCmd) const;
+    CRedisServer * GetMatchedSlave(const CRedisCommand *pRedisCmd) const;
 
     bool LoadSlaveInfo(const std::map<std::string, std::string> &mapInfo);
+    bool FetchInfo(CRedisServer *pRedisServ, std::map<std::string, std::string> &mapInfo);
+    bool NeedSlavePool() const { return m_bHedgeRead || m_bReplicaRead; }
+    bool QuerySentinelMaster(std::string &strHost, int &nPort);
+    bool RefreshSentinel();
+    bool RefreshShard();
+    bool SwitchMaster(const std::string &strHost, int nPort);
+    void WatchSentinel();
     bool LoadClusterSlots();
-    bool WaitForRefresh();
+    bool ApplySlotMap(std::vector<SlotRegion> &vecSlot, const std::string &strSign);
+    bool LoadSlotSnapshot();
+    void SaveSlotSnapshot(const std::vector<SlotRegion> &vecSlot) const;
+    bool WaitForRefresh(const CDeadline &deadline);
+    void RequestRefresh();
+    bool CanRetry(int nRet, const CRedisCommand *pRedisCmd);
     int Execute(CRedisCommand *pRedisCmd);
 	int ExecutePool(CRedisConnection* connection, CRedisCommand *pRedisCmd);
     int SimpleExecute(CRedisCommand *pRedisCmd);
 	int SimpleExecute(CRedisConnection* connection, CRedisCommand *pRedisCmd);
 
-    int ExecuteImpl(const std::string &strCmd, int nSlot,
+    int ExecuteImpl(const std::string &strCmd, int nSlot, const CDeadline &deadline,
 		TFuncFetch funcFetch, TFuncConvert funcConv = FUNC_DEF_CONV);
-	int ExecuteImplPool(CRedisConnection* connection, const std::string &strCmd, int nSlot,
+	int ExecuteImplPool(CRedisConnection* connection, const std::string &strCmd, int nSlot, const CDeadline &deadline,
+		TFuncFetch funcFetch, TFuncConvert funcConv = FUNC_DEF_CONV);
+	int ExecuteHedged(const std::string &strCmd, int nSlot, const CDeadline &deadline,
+		TFuncFetch funcFetch, TFuncConvert funcConv = FUNC_DEF_CONV);
+	int ExecuteReplica(const std::string &strCmd, int nSlot, const CDeadline &deadline,
 		TFuncFetch funcFetch, TFuncConvert funcConv = FUNC_DEF_CONV);
 
   //  template <typename P>
@@ -508,22 +1236,69 @@ private:
 	int m_nClientTimeout;
 	int m_nServerTimeout;
 	int m_nConnNum;
+	int m_nMinIdle;
+	RedisTimeout m_redisTimeout;
+	RedisHandshake m_redisHandshake;
+	RedisSocketOpt m_socketOpt;
+	RedisLimit m_redisLimit;
+	std::shared_ptr<CInFlight> m_pInFlight;
+	std::vector<int> m_vecCpu;
+	CRetryBudget m_retryBudget;
 	bool m_bCluster;
+	bool m_bShard;
 	bool m_bValid;
 	bool m_bExit;
 
 	std::vector<SlotRegion> m_vecSlot;
 	std::atomic<std::vector<CRedisServer*>*>	m_vecRedisServ;
+	std::vector<CRedisServer*>*	m_vecSlaveServ;
 	std::list<ServerInfoQ>	m_oldServerInfoList;
 
-#if defined(linux) || defined(__linux) || defined(__linux__)
-	pthread_rwlockattr_t m_rwAttr;
-#endif
-	//pthread_rwlock_t m_rwLock;
-	SRWLOCK				m_rwLock;
-	std::condition_variable_any m_condAny;
+	CRWLock				m_rwLock;
 	std::thread *m_pThread;
 
+	bool m_bReplicaRead;
+	bool m_bHedgeRead;
+	double m_dHedgePercentile;
+	int m_nHedgeMinDelay;
+	int m_nHedgeWorkers;
+	CLatencyWindow m_latPrimary;
+	CTaskPool m_poolHedge;
+	CRetryBudget m_hedgeBudget;
+	CTaskPool m_poolMget;
+	CRedisEngine m_engine;
+	// one connection pools of the replicas without a pool, kept for the next FanOut over all nodes
+	std::map<std::pair<std::string, int>, std::shared_ptr<CRedisServer> > m_mapFanOutServ;
+	std::mutex m_mutexFanOut;
+
+	// refresh requests, progress and the completed generation, guarded by m_mutexRefresh
+	std::mutex m_mutexRefresh;
+	std::condition_variable m_condRefresh;
+	bool m_bRefreshRequested;
+	bool m_bRefreshing;
+	uint64_t m_nRefreshGen;
+	int m_nRefreshInterval;
+	int m_nRefreshJitter;
+	int m_nRefreshSeeds;
+	size_t m_nRefreshRound;
+	std::atomic<bool> m_bShardsCmd;		// cleared by the first node without CLUSTER SHARDS (before 7.0)
+	std::string m_strSlotSign;
+	std::string m_strSnapshot;
+
+	std::atomic<int64_t> m_nInitMs;
+	std::atomic<int64_t> m_nSlotLoadMs;
+
+	bool m_bSentinel;
+	std::string m_strMasterName;
+	std::vector<std::pair<std::string, int> > m_vecSentinel;
+	std::pair<std::string, int> m_switchHost;   // announced by +switch-master, guarded by m_mutexRefresh
+	std::thread *m_pSentinelThread;
+
+	int m_nPingIdle;
+	int m_nEvictIdle;
+	std::thread *m_pSweepThread;
+	std::thread *m_pReconnThread;
+
 //#ifdef _DEBUG
 //public:
 //	template<typename ... Args>	inline void client_log_trace(Args const& ... args) { client_log(spdlog::level::trace, args...); }
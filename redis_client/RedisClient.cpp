@@ -1,6 +1,45 @@
-﻿#include <WinSock2.h>
+﻿#if defined(_WIN32)
+#include <WinSock2.h>
+#endif
 #include <atomic>
 #include <iterator>
+#include <future>
+#include <random>
+#include <fstream>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#if defined(linux) || defined(__linux) || defined(__linux__)
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <unistd.h>
+#include <climits>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <linux/errqueue.h>
+#include "hiredis/async.h"
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+#endif
+// multishot receive came with linux 6.0 headers, the running kernel is probed in CUringRing::Init
+#if defined(IORING_RECV_MULTISHOT) && defined(__NR_io_uring_setup)
+#define URING_SUPPORTED
+#endif
+#if defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY) && defined(SO_EE_ORIGIN_ZEROCOPY)
+#define ZEROCOPY_SUPPORTED
+#endif
 #include "redis_client/RedisClient.hpp"
 
 #define BIND_INT(val) std::bind(&FetchInteger, std::placeholders::_1, val)
@@ -10,6 +49,7 @@
 #define BIND_MAP(val) std::bind(&FetchMap, std::placeholders::_1, val)
 #define BIND_TIME(val) std::bind(&FetchTime, std::placeholders::_1, val)
 #define BIND_SLOT(val) std::bind(&FetchSlot, std::placeholders::_1, val)
+#define BIND_SHARD(val) std::bind(&FetchShards, std::placeholders::_1, val)
 #define BIND_MULTI(val) std::bind(&FetchMulti, std::placeholders::_1, val)
 
 // crc16 for computing redis cluster slot
@@ -49,42 +89,74 @@ static const uint16_t crc16Table[256] =
     0x6e17, 0x7e36, 0x4e55, 0x5e74, 0x2e93, 0x3eb2, 0x0ed1, 0x1ef0
 };
 
+// slicing-by-8 tables: crc16Slice[k][b] is the crc of byte b followed by k zero bytes
+struct CRC16Slice
+{
+    uint16_t szTable[8][256];
+    CRC16Slice()
+    {
+        for (int i = 0; i < 256; ++i)
+            szTable[0][i] = crc16Table[i];
+        for (int k = 1; k < 8; ++k)
+        {
+            for (int i = 0; i < 256; ++i)
+                szTable[k][i] = (szTable[k - 1][i] << 8) ^ crc16Table[szTable[k - 1][i] >> 8];
+        }
+    }
+};
+
 uint16_t CRC16(const char *pszData, int nLen)
 {
-    int nCounter;
+    // built on first use, HASH_SLOT may run from the static initializer of another translation unit
+    static const CRC16Slice crc16Slice;
+    const unsigned char *pszByte = reinterpret_cast<const unsigned char *>(pszData);
+    const uint16_t (*szTable)[256] = crc16Slice.szTable;
     uint16_t nCrc = 0;
-    for (nCounter = 0; nCounter < nLen; nCounter++)
-        nCrc = (nCrc << 8) ^ crc16Table[((nCrc >> 8) ^ * pszData++) & 0x00FF];
+    for (; nLen >= 8; nLen -= 8, pszByte += 8)
+    {
+        nCrc = szTable[7][(nCrc >> 8) ^ pszByte[0]] ^ szTable[6][(nCrc & 0xFF) ^ pszByte[1]] ^
+               szTable[5][pszByte[2]] ^ szTable[4][pszByte[3]] ^ szTable[3][pszByte[4]] ^
+               szTable[2][pszByte[5]] ^ szTable[1][pszByte[6]] ^ szTable[0][pszByte[7]];
+    }
+    while (nLen-- > 0)
+        nCrc = (nCrc << 8) ^ crc16Table[((nCrc >> 8) ^ *pszByte++) & 0x00FF];
     return nCrc;
 }
 
-uint32_t CRedisClient::HASH_SLOT(const std::string &strKey)
+uint32_t KeyHashSlot(const char *pszKey, size_t nKeyLen)
 {
-    const char *pszKey = strKey.data();
-    size_t nKeyLen = strKey.size();
-    size_t nStart, nEnd; /* start-end indexes of { and  } */
-
     /* Search the first occurrence of '{'. */
-    for (nStart = 0; nStart < nKeyLen; nStart++)
-        if (pszKey[nStart] == '{')
-            break;
+    const char *pszStart = static_cast<const char *>(memchr(pszKey, '{', nKeyLen));
 
     /* No '{' ? Hash the whole key. This is the base case. */
-    if (nStart == nKeyLen)
+    if (!pszStart)
         return CRC16(pszKey, nKeyLen) & 16383;
 
     /* '{' found? Check if we have the corresponding '}'. */
-    for (nEnd = nStart + 1; nEnd < nKeyLen; nEnd++)
-        if (pszKey[nEnd] == '}')
-            break;
+    const char *pszEnd = static_cast<const char *>(memchr(pszStart + 1, '}', pszKey + nKeyLen - pszStart - 1));
 
     /* No '}' or nothing between {} ? Hash the whole key. */
-    if (nEnd == nKeyLen || nEnd == nStart + 1)
+    if (!pszEnd || pszEnd == pszStart + 1)
         return CRC16(pszKey, nKeyLen) & 16383;
 
     /* If we are here there is both a { and a  } on its right. Hash
      * what is in the middle between { and  }. */
-    return CRC16(pszKey + nStart + 1, nEnd - nStart - 1) & 16383;
+    return CRC16(pszStart + 1, pszEnd - pszStart - 1) & 16383;
+}
+
+uint32_t CRedisClient::HASH_SLOT(const std::string &strKey)
+{
+    return KeyHashSlot(strKey.data(), strKey.size());
+}
+
+void CRedisClient::HASH_SLOT(const std::vector<std::string> &vecKey, std::vector<uint32_t> *pvecSlot)
+{
+    if (!pvecSlot)
+        return;
+
+    pvecSlot->resize(vecKey.size());
+    for (size_t i = 0; i < vecKey.size(); ++i)
+        (*pvecSlot)[i] = KeyHashSlot(vecKey[i].data(), vecKey[i].size());
 }
 
 static inline std::ostream & operator<<(std::ostream &os, const std::pair<int, redisReply *> &pairReply)
@@ -137,12 +209,79 @@ bool operator< (const SlotRegion &lReg, const SlotRegion &rReg)
     return lReg.nStartSlot < rReg.nStartSlot;
 }
 
-//class CompSlot
-//{
-//public:
-//    bool operator()(const SlotRegion &slotReg, int nSlot) { return slotReg.nEndSlot < nSlot; }
-//    bool operator()(int nSlot, const SlotRegion &slotReg) { return nSlot < slotReg.nStartSlot; }
-//};
+// a sorted slot map flattened to a string, to compare the views of different nodes
+static std::string SlotSignature(const std::vector<SlotRegion> &vecSlot)
+{
+    std::string strSign;
+    for (auto &slotReg : vecSlot)
+    {
+        strSign += std::to_string(slotReg.nStartSlot) + "-" + std::to_string(slotReg.nEndSlot) + " " +
+            slotReg.strHost + ":" + std::to_string(slotReg.nPort) + (slotReg.strNodeId.empty() ? "" : "@" + slotReg.strNodeId);
+        for (auto &slavePair : slotReg.vecSlave)
+            strSign += "," + slavePair.first + ":" + std::to_string(slavePair.second);
+        strSign += ";";
+    }
+    return strSign;
+}
+
+class CompSlot
+{
+public:
+    bool operator()(const SlotRegion &slotReg, int nSlot) const { return slotReg.nEndSlot < nSlot; }
+    bool operator()(int nSlot, const SlotRegion &slotReg) const { return nSlot < slotReg.nStartSlot; }
+};
+
+// FNV-1a with the murmur3 finalizer, the ring points of one node must not cluster
+static uint32_t RingHash(const std::string &strPoint)
+{
+    uint32_t nHash = 2166136261u;
+    for (unsigned char c : strPoint)
+        nHash = (nHash ^ c) * 16777619u;
+    nHash ^= nHash >> 16;
+    nHash *= 0x85ebca6b;
+    nHash ^= nHash >> 13;
+    nHash *= 0xc2b2ae35;
+    nHash ^= nHash >> 16;
+    return nHash;
+}
+
+// ketama style ring with SHARD_VNODE_NUM points per node. the slots are laid evenly on the ring,
+// each one belongs to the next point clockwise, so a key (or its hash tag) reaches a node through
+// its slot and the slot map of cluster mode routes the shards too
+static void BuildShardSlots(const std::vector<std::pair<std::string, int> > &vecShard, std::vector<SlotRegion> &vecSlot)
+{
+    std::vector<std::pair<uint32_t, size_t> > vecRing;
+    for (size_t i = 0; i < vecShard.size(); ++i)
+    {
+        std::string strNode = vecShard[i].first + ":" + std::to_string(vecShard[i].second) + "-";
+        for (int j = 0; j < SHARD_VNODE_NUM; ++j)
+            vecRing.push_back(std::make_pair(RingHash(strNode + std::to_string(j)), i));
+    }
+    std::sort(vecRing.begin(), vecRing.end());
+
+    vecSlot.clear();
+    size_t nPoint = 0;
+    for (int nSlot = 0; nSlot < 16384; ++nSlot)
+    {
+        uint32_t nPos = static_cast<uint32_t>(nSlot) << 18;
+        while (nPoint < vecRing.size() && vecRing[nPoint].first < nPos)
+            ++nPoint;
+        const std::pair<std::string, int> &shardPair = vecShard[vecRing[nPoint == vecRing.size() ? 0 : nPoint].second];
+        if (!vecSlot.empty() && vecSlot.back().strHost == shardPair.first && vecSlot.back().nPort == shardPair.second)
+        {
+            vecSlot.back().nEndSlot = nSlot;
+            continue;
+        }
+
+        SlotRegion slotReg;
+        slotReg.nStartSlot = slotReg.nEndSlot = nSlot;
+        slotReg.strHost = shardPair.first;
+        slotReg.nPort = shardPair.second;
+        slotReg.pRedisServ = nullptr;
+        slotReg.pSlaveServ = nullptr;
+        vecSlot.push_back(slotReg);
+    }
+}
 
 class IntResConv
 {
@@ -340,6 +479,105 @@ static inline int FetchTime(redisReply *pReply, struct timeval *ptmVal)
         return RC_REPLY_ERR;
 }
 
+// field of a map reply, RESP2 sends maps as flat key/value arrays
+static inline bool FetchMapField(redisReply *pReply, const char *pszField, std::string *pstrVal)
+{
+    if (pReply->type != REDIS_REPLY_ARRAY)
+        return false;
+    for (size_t i = 0; i + 1 < pReply->elements; i += 2)
+    {
+        redisReply *pKey = pReply->element[i];
+        redisReply *pVal = pReply->element[i + 1];
+        if (pKey->type != REDIS_REPLY_STRING || strcmp(pKey->str, pszField) != 0)
+            continue;
+        if (pVal->type == REDIS_REPLY_STRING || pVal->type == REDIS_REPLY_STATUS)
+            pstrVal->assign(pVal->str, pVal->len);
+        else if (pVal->type == REDIS_REPLY_INTEGER)
+            *pstrVal = std::to_string(pVal->integer);
+        else
+            return false;
+        return true;
+    }
+    return false;
+}
+
+static inline redisReply *FetchMapValue(redisReply *pReply, const char *pszField)
+{
+    for (size_t i = 0; pReply->type == REDIS_REPLY_ARRAY && i + 1 < pReply->elements; i += 2)
+    {
+        if (pReply->element[i]->type == REDIS_REPLY_STRING && strcmp(pReply->element[i]->str, pszField) == 0)
+            return pReply->element[i + 1];
+    }
+    return nullptr;
+}
+
+// CLUSTER SHARDS: [[slots, [start, end, ...], nodes, [[id, .., port, .., ip, .., endpoint, .., role, ..], ...]], ...]
+static inline int FetchShards(redisReply *pReply, std::vector<SlotRegion> *pvecSlot)
+{
+    if (pReply->type != REDIS_REPLY_ARRAY)
+        return RC_REPLY_ERR;
+    if (!pvecSlot)
+        return RC_SUCCESS;
+
+    pvecSlot->clear();
+    for (size_t i = 0; i < pReply->elements; ++i)
+    {
+        redisReply *pSlots = FetchMapValue(pReply->element[i], "slots");
+        redisReply *pNodes = FetchMapValue(pReply->element[i], "nodes");
+        if (!pSlots || !pNodes || pSlots->type != REDIS_REPLY_ARRAY || pNodes->type != REDIS_REPLY_ARRAY)
+            return RC_REPLY_ERR;
+
+        SlotRegion slotReg;
+        slotReg.pRedisServ = nullptr;
+        slotReg.pSlaveServ = nullptr;
+        for (size_t j = 0; j < pNodes->elements; ++j)
+        {
+            RedisNode redisNode;
+            std::string strVal;
+            FetchMapField(pNodes->element[j], "id", &redisNode.strId);
+            FetchMapField(pNodes->element[j], "ip", &redisNode.strIp);
+            FetchMapField(pNodes->element[j], "hostname", &redisNode.strHostname);
+            FetchMapField(pNodes->element[j], "endpoint", &redisNode.strHost);
+            FetchMapField(pNodes->element[j], "health", &redisNode.strHealth);
+            redisNode.nPort = FetchMapField(pNodes->element[j], "port", &strVal) ? atoi(strVal.c_str()) : 0;
+            redisNode.nTlsPort = FetchMapField(pNodes->element[j], "tls-port", &strVal) ? atoi(strVal.c_str()) : 0;
+            redisNode.nReplOffset = FetchMapField(pNodes->element[j], "replication-offset", &strVal) ? atoll(strVal.c_str()) : -1;
+            redisNode.bMaster = FetchMapField(pNodes->element[j], "role", &strVal) && strVal == "master";
+            if (redisNode.strHost.empty() || redisNode.strHost == "?")
+                redisNode.strHost = redisNode.strIp;
+            // a node with only a tls-port can not be reached by the plaintext connections
+            if (redisNode.nPort <= 0)
+                continue;
+
+            if (redisNode.bMaster)
+                slotReg.vecNode.insert(slotReg.vecNode.begin(), redisNode);
+            else
+                slotReg.vecNode.push_back(redisNode);
+        }
+        // a shard without slots, or whose master is gone, is left out of the map
+        if (pSlots->elements < 2 || slotReg.vecNode.empty() || !slotReg.vecNode.front().bMaster)
+            continue;
+
+        slotReg.strHost = slotReg.vecNode.front().strHost;
+        slotReg.nPort = slotReg.vecNode.front().nPort;
+        slotReg.strNodeId = slotReg.vecNode.front().strId;
+        for (size_t j = 1; j < slotReg.vecNode.size(); ++j)
+        {
+            // replicas still loading or failed are not read from
+            const RedisNode &redisNode = slotReg.vecNode[j];
+            if (redisNode.strHealth.empty() || redisNode.strHealth == "online")
+                slotReg.vecSlave.push_back(std::make_pair(redisNode.strHost, redisNode.nPort));
+        }
+        for (size_t j = 0; j + 1 < pSlots->elements; j += 2)
+        {
+            slotReg.nStartSlot = static_cast<int>(pSlots->element[j]->integer);
+            slotReg.nEndSlot = static_cast<int>(pSlots->element[j + 1]->integer);
+            pvecSlot->push_back(slotReg);
+        }
+    }
+    return RC_SUCCESS;
+}
+
 static inline int FetchSlot(redisReply *pReply, std::vector<SlotRegion> *pvecSlot)
 {
     if (pReply->type == REDIS_REPLY_ARRAY)
@@ -358,8 +596,46 @@ static inline int FetchSlot(redisReply *pReply, std::vector<SlotRegion> *pvecSlo
             slotReg.nStartSlot = pSubReply->element[0]->integer;
             slotReg.nEndSlot = pSubReply->element[1]->integer;
             slotReg.pRedisServ = nullptr;
-            slotReg.strHost = pSubReply->element[2]->element[0]->str;
-            slotReg.nPort = pSubReply->element[2]->element[1]->integer;
+            slotReg.pSlaveServ = nullptr;
+            slotReg.vecSlave.clear();
+            slotReg.vecNode.clear();
+            for (size_t j = 2; j < pSubReply->elements; ++j)
+            {
+                // [endpoint, port, id (3.0), metadata (7.0)]
+                redisReply *pNodeReply = pSubReply->element[j];
+                if (pNodeReply->type != REDIS_REPLY_ARRAY || pNodeReply->elements < 2)
+                    continue;
+
+                RedisNode redisNode;
+                redisNode.nPort = static_cast<int>(pNodeReply->element[1]->integer);
+                redisNode.nTlsPort = 0;
+                redisNode.bMaster = (j == 2);
+                redisNode.nReplOffset = -1;
+                std::string strEndpoint;
+                if (pNodeReply->element[0]->type == REDIS_REPLY_STRING)
+                    strEndpoint.assign(pNodeReply->element[0]->str, pNodeReply->element[0]->len);
+                if (pNodeReply->elements > 2 && pNodeReply->element[2]->type == REDIS_REPLY_STRING)
+                    redisNode.strId.assign(pNodeReply->element[2]->str, pNodeReply->element[2]->len);
+
+                // the metadata carries the ip when the endpoint is a hostname ("?" if none is announced)
+                redisNode.strIp = strEndpoint;
+                if (pNodeReply->elements > 3 && FetchMapField(pNodeReply->element[3], "ip", &redisNode.strIp))
+                    redisNode.strHostname = strEndpoint == "?" ? "" : strEndpoint;
+                else if (pNodeReply->elements > 3)
+                    FetchMapField(pNodeReply->element[3], "hostname", &redisNode.strHostname);
+                if (redisNode.strIp == "?")
+                    redisNode.strIp.clear();
+                // left empty for a nil endpoint, which means the node that answered
+                redisNode.strHost = (strEndpoint.empty() || strEndpoint == "?") ? redisNode.strIp : strEndpoint;
+                if (!redisNode.bMaster)
+                    slotReg.vecSlave.push_back(std::make_pair(redisNode.strHost, redisNode.nPort));
+                slotReg.vecNode.push_back(redisNode);
+            }
+            if (slotReg.vecNode.empty() || !slotReg.vecNode.front().bMaster)
+                return RC_REPLY_ERR;
+            slotReg.strHost = slotReg.vecNode.front().strHost;
+            slotReg.nPort = slotReg.vecNode.front().nPort;
+            slotReg.strNodeId = slotReg.vecNode.front().strId;
             pvecSlot->push_back(slotReg);
         }
         return RC_SUCCESS;
@@ -368,6 +644,27 @@ static inline int FetchSlot(redisReply *pReply, std::vector<SlotRegion> *pvecSlo
         return RC_REPLY_ERR;
 }
 
+static inline int FetchNodeReply(redisReply *pReply, NodeReply *pNodeReply)
+{
+    switch (pReply->type)
+    {
+    case REDIS_REPLY_INTEGER:
+        pNodeReply->nVal = static_cast<long>(pReply->integer);
+        return RC_SUCCESS;
+    case REDIS_REPLY_STRING:
+    case REDIS_REPLY_STATUS:
+    case REDIS_REPLY_NIL:
+        return FetchString(pReply, &pNodeReply->strVal);
+    case REDIS_REPLY_ARRAY:
+        return FetchStringArray(pReply, &pNodeReply->vecVal);
+    case REDIS_REPLY_ERROR:
+        pNodeReply->strVal.assign(pReply->str, pReply->len);
+        return RC_REPLY_ERR;
+    default:
+        return RC_REPLY_ERR;
+    }
+}
+
 static inline int FetchMulti(redisReply *pReply, OUT RedisResult* result)
 {
 	if (nullptr == result)
@@ -436,10 +733,13 @@ static inline int FetchMulti(redisReply *pReply, OUT RedisResult* result)
 	return RC_SUCCESS;
 }
 
+thread_local int CRedisPriority::s_nCurrent = PRIO_NORMAL;
+
 // CRedisCommand methods
 CRedisCommand::CRedisCommand(const std::string &strCmd, bool bShareMem)
     : m_strCmd(strCmd), m_bShareMem(bShareMem), m_nArgs(0), m_nIdx(0), m_pszArgs(nullptr),
-      m_pnArgsLen(nullptr), m_pReply(nullptr), m_nSlot(-1), m_funcConv(FUNC_DEF_CONV)
+      m_pnArgsLen(nullptr), m_pReply(nullptr), m_nSlot(-1), m_nTimeout(-1), m_nPriority(CRedisPriority::Current()),
+      m_funcConv(FUNC_DEF_CONV)
 {
 }
 
@@ -642,7 +942,7 @@ void CRedisCommand::AppendValue(const std::string &strVal)
     ++m_nIdx;
 }
 
-int CRedisCommand::CmdRequest(redisContext *pContext)
+int CRedisCommand::CmdRequest(redisContext *pContext, CUringRing *pUring, CZeroCopy *pZeroCopy)
 {
     //if (m_nArgs <= 0)
     //    return RC_PARAM_ERR;
@@ -658,6 +958,31 @@ int CRedisCommand::CmdRequest(redisContext *pContext)
         m_pReply = nullptr;
     }
 
+	if (pUring)
+	{
+		char *pszCmd = nullptr;
+		int nLen = redisFormatCommand(&pszCmd, m_strCmd.c_str());
+		if (nLen < 0)
+			return RC_RQST_ERR;
+		int nRet = pUring->Request(pContext, pszCmd, nLen, &m_pReply);
+		redisFreeCommand(pszCmd);
+		return nRet;
+	}
+
+	if (pZeroCopy && m_strCmd.size() >= pZeroCopy->MinSize())
+	{
+		char *pszCmd = nullptr;
+		int nLen = redisFormatCommand(&pszCmd, m_strCmd.c_str());
+		if (nLen < 0)
+			return RC_RQST_ERR;
+		if (pZeroCopy->Send(pContext, pszCmd, nLen) != RC_SUCCESS)
+			return RC_RQST_ERR;
+		int nRet = redisGetReply(pContext, (void **)&m_pReply) == REDIS_OK ? RC_SUCCESS : RC_RQST_ERR;
+		// the server has read the value, so its completion is usually queued already
+		pZeroCopy->Reap(0);
+		return nRet;
+	}
+
 	m_pReply = static_cast<redisReply *>(redisCommand(pContext, m_strCmd.c_str()));
 //    m_pReply = static_cast<redisReply *>(redisCommandArgv(pContext, m_nArgs, (const char **)m_pszArgs, (const size_t *)m_pnArgsLen));
     return m_pReply ? RC_SUCCESS : RC_RQST_ERR;
@@ -677,13 +1002,15 @@ int CRedisCommand::CmdAppend(redisContext *pContext)
     //return nRet == REDIS_OK ? RC_SUCCESS : RC_RQST_ERR;
 }
 
-int CRedisCommand::CmdReply(redisContext *pContext)
+int CRedisCommand::CmdReply(redisContext *pContext, CUringRing *pUring)
 {
     if (m_pReply)
     {
         freeReplyObject(m_pReply);
         m_pReply = nullptr;
     }
+    if (pUring)
+        return pUring->Request(pContext, nullptr, 0, &m_pReply);
 
     return redisGetReply(pContext, (void **)&m_pReply) == REDIS_OK ? RC_SUCCESS : RC_RQST_ERR;
 }
@@ -693,336 +1020,2414 @@ int CRedisCommand::FetchResult(const TFuncFetch &funcFetch)
     return m_funcConv(funcFetch(m_pReply), m_pReply);
 }
 
-// CRedisConnection methods
-CRedisConnection::CRedisConnection(CRedisServer *pRedisServ) : m_pContext(nullptr), m_nUseTime(0), m_pRedisServ(pRedisServ)
+static inline int64_t SteadyMs()
 {
-    Reconnect();
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
 }
-CRedisConnection::~CRedisConnection()
+
+// "unix:///path/redis.sock" endpoints use a unix domain socket, their port is ignored
+static const char s_szUnixPrefix[] = "unix://";
+
+static inline bool IsUnixHost(const std::string &strHost)
 {
-	if (m_pContext)
-        redisFree(m_pContext);
-//	delete m_pRedisServ;
-//	m_pRedisServ = nullptr;
+    return strHost.compare(0, sizeof(s_szUnixPrefix) - 1, s_szUnixPrefix) == 0;
 }
-int CRedisConnection::ConnRequest(CRedisCommand *pRedisCmd)
+
+// equal jitter: half of the delay is kept, the other half is random, so nodes which died
+// together are not retried in lockstep
+static int JitterMs(int nMs)
+{
+    static thread_local std::minstd_rand rndJitter(std::random_device{}());
+    return nMs / 2 + static_cast<int>(rndJitter() % (nMs / 2 + 1));
+}
+
+// set on the I/O engine loop threads, which run the AsyncCommand callbacks
+static thread_local bool s_bLoopThread = false;
+
+// restricts the calling thread to vecCpu, nothing when it is empty. called first thing in a thread
+// so whatever it allocates afterwards is first touched on the local numa node
+static void PinThread(const std::vector<int> &vecCpu)
 {
-	time_t tmNow = time(nullptr);
-	if (!m_pContext || tmNow - m_nUseTime >= m_pRedisServ->m_nSerTimeout)
+#if defined(linux) || defined(__linux) || defined(__linux__)
+	cpu_set_t setCpu;
+	CPU_ZERO(&setCpu);
+	for (int nCpu : vecCpu)
 	{
-		if (!Reconnect())
-		{
-			return RC_RQST_ERR;
-		}			
+		if (nCpu >= 0 && nCpu < CPU_SETSIZE)
+			CPU_SET(nCpu, &setCpu);
 	}
+	if (CPU_COUNT(&setCpu) > 0)
+		pthread_setaffinity_np(pthread_self(), sizeof(setCpu), &setCpu);
+#else
+	(void)vecCpu;
+#endif
+}
 
-    int nRet = pRedisCmd->CmdRequest(m_pContext);
-    if (nRet == RC_RQST_ERR)
-    {
-        if (tmNow - m_nUseTime < m_pRedisServ->m_nSerTimeout)
-            return nRet;
-        else if (!Reconnect())
-            return RC_RQST_ERR;
-        else
-            nRet = pRedisCmd->CmdRequest(m_pContext);
-    }
+// CUringRing methods
+#ifdef URING_SUPPORTED
+static const uint64_t s_nUringRecv = 1;
+static const uint64_t s_nUringSend = 2;
+static const uint64_t s_nUringCancel = 3;
 
-    if (nRet != RC_RQST_ERR)
-        m_nUseTime = tmNow;
-    return nRet;
+static inline int UringEnter(int nRing, unsigned nSubmit, unsigned nWait, unsigned nFlags, void *pArg, size_t nArgSize)
+{
+	return static_cast<int>(syscall(__NR_io_uring_enter, nRing, nSubmit, nWait, nFlags, pArg, nArgSize));
 }
+#endif
 
-int CRedisConnection::ConnRequest(std::vector<CRedisCommand *> &vecRedisCmd)
+CUringRing::CUringRing()
+	: m_nRing(-1), m_nFd(-1), m_pRing(nullptr), m_nRingSize(0), m_pSqes(nullptr), m_nSqeSize(0),
+	  m_pSqHead(nullptr), m_pSqTail(nullptr), m_pSqMask(nullptr), m_pSqArray(nullptr),
+	  m_pCqHead(nullptr), m_pCqTail(nullptr), m_pCqMask(nullptr), m_pCqes(nullptr),
+	  m_pBufRing(nullptr), m_pBufMem(nullptr), m_nBufNum(URING_BUF_NUM), m_nBufTail(0), m_bRecvArmed(false), m_nInFlight(0),
+	  m_nSendOff(0), m_nTimeout(-1)
 {
-    time_t tmNow = time(nullptr);
-    if (!m_pContext || tmNow - m_nUseTime >= m_pRedisServ->m_nSerTimeout)
-    {
-        if (!Reconnect())
-            return RC_RQST_ERR;
-    }
-
-    int nRet = RC_SUCCESS;
-    //for (size_t i = 0; i < vecRedisCmd.size() && nRet == RC_SUCCESS; ++i)
-    //    nRet = vecRedisCmd[i]->CmdAppend(m_pContext);
-    for (size_t i = 0; i < vecRedisCmd.size() && nRet == RC_SUCCESS; ++i)
-        nRet = vecRedisCmd[i]->CmdReply(m_pContext);
-    return nRet;
 }
 
-bool CRedisConnection::ConnectToRedis(const std::string &strHost, int nPort, int nTimeout)
+#ifdef URING_SUPPORTED
+CUringRing::~CUringRing()
 {
-	if (m_pContext)
+	// the kernel may still write into the buffers, so everything in flight is cancelled and reaped
+	// first. buffers of a ring which does not settle are leaked rather than reused
+	bool bSettled = m_nInFlight == 0;
+	if (m_nRing >= 0 && !bSettled)
 	{
-		redisFree(m_pContext);
-		m_pContext = nullptr;
+		struct io_uring_sqe *pSqe = &static_cast<struct io_uring_sqe *>(m_pSqes)[*m_pSqTail & *m_pSqMask];
+		memset(pSqe, 0, sizeof(*pSqe));
+		pSqe->opcode = IORING_OP_ASYNC_CANCEL;
+		pSqe->fd = -1;
+		pSqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+		pSqe->user_data = s_nUringCancel;
+		m_pSqArray[*m_pSqTail & *m_pSqMask] = *m_pSqTail & *m_pSqMask;
+		__atomic_store_n(m_pSqTail, *m_pSqTail + 1, __ATOMIC_RELEASE);
+
+		int64_t nEnd = SteadyMs() + 100;
+		while (m_nInFlight > 0 && SteadyMs() < nEnd)
+		{
+			struct __kernel_timespec tsWait = { 0, 10 * 1000 * 1000 };
+			struct io_uring_getevents_arg argWait;
+			memset(&argWait, 0, sizeof(argWait));
+			argWait.ts = reinterpret_cast<uint64_t>(&tsWait);
+			unsigned nSubmit = *m_pSqTail - __atomic_load_n(m_pSqHead, __ATOMIC_ACQUIRE);
+			UringEnter(m_nRing, nSubmit, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &argWait, sizeof(argWait));
+
+			unsigned nHead = *m_pCqHead;
+			for (unsigned nTail = __atomic_load_n(m_pCqTail, __ATOMIC_ACQUIRE); nHead != nTail; ++nHead)
+			{
+				struct io_uring_cqe *pCqe = &static_cast<struct io_uring_cqe *>(m_pCqes)[nHead & *m_pCqMask];
+				if (pCqe->user_data == s_nUringSend || (pCqe->user_data == s_nUringRecv && !(pCqe->flags & IORING_CQE_F_MORE)))
+					--m_nInFlight;
+			}
+			__atomic_store_n(m_pCqHead, nHead, __ATOMIC_RELEASE);
+		}
+		bSettled = m_nInFlight == 0;
 	}
 
-    struct timeval tmTimeout = {static_cast<long>(nTimeout), 0};
-    m_pContext = redisConnectWithTimeout(strHost.c_str(), nPort, tmTimeout);
-    if (!m_pContext || m_pContext->err)
-    {
-        if (m_pContext)
-        {
-            redisFree(m_pContext);
-            m_pContext = nullptr;
-        }
-        return false;
-    }
-
-    //redisSetTimeout(m_pContext, tmTimeout);
-    m_nUseTime = time(nullptr);
-    return true;
+	if (m_nRing >= 0)
+		close(m_nRing);
+	if (m_pSqes)
+		munmap(m_pSqes, m_nSqeSize);
+	if (m_pRing)
+		munmap(m_pRing, m_nRingSize);
+	if (bSettled)
+	{
+		if (m_pBufRing)
+			munmap(m_pBufRing, m_nBufNum * sizeof(struct io_uring_buf));
+		delete[] m_pBufMem;
+	}
 }
 
-bool CRedisConnection::Reconnect()
+bool CUringRing::Init(int nFd)
 {
-	if (!m_pRedisServ->m_strHost.empty() &&
-		ConnectToRedis(m_pRedisServ->m_strHost, m_pRedisServ->m_nPort, m_pRedisServ->m_nCliTimeout))
-		return true;
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	m_nRing = static_cast<int>(syscall(__NR_io_uring_setup, 8, &params));
+	if (m_nRing < 0 || !(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG))
+		return false;
+
+	m_nRingSize = std::max(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+		params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe));
+	m_pRing = mmap(nullptr, m_nRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_nRing, IORING_OFF_SQ_RING);
+	m_nSqeSize = params.sq_entries * sizeof(struct io_uring_sqe);
+	m_pSqes = mmap(nullptr, m_nSqeSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_nRing, IORING_OFF_SQES);
+	if (m_pRing == MAP_FAILED || m_pSqes == MAP_FAILED)
+	{
+		m_pRing = m_pRing == MAP_FAILED ? nullptr : m_pRing;
+		m_pSqes = m_pSqes == MAP_FAILED ? nullptr : m_pSqes;
+		return false;
+	}
+
+	char *pRing = static_cast<char *>(m_pRing);
+	m_pSqHead = reinterpret_cast<unsigned *>(pRing + params.sq_off.head);
+	m_pSqTail = reinterpret_cast<unsigned *>(pRing + params.sq_off.tail);
+	m_pSqMask = reinterpret_cast<unsigned *>(pRing + params.sq_off.ring_mask);
+	m_pSqArray = reinterpret_cast<unsigned *>(pRing + params.sq_off.array);
+	m_pCqHead = reinterpret_cast<unsigned *>(pRing + params.cq_off.head);
+	m_pCqTail = reinterpret_cast<unsigned *>(pRing + params.cq_off.tail);
+	m_pCqMask = reinterpret_cast<unsigned *>(pRing + params.cq_off.ring_mask);
+	m_pCqes = pRing + params.cq_off.cqes;
+
+	if (!SetupBuffer())
+		return false;
 
-	if (0 < m_pRedisServ->m_vecHosts.size())
+	// multishot receive came with linux 6.0, an older kernel rejects it at submit with EINVAL. the
+	// receive armed here is the one the first request would arm anyway
+	m_nFd = nFd;
+	QueueRecv();
+	if (UringEnter(m_nRing, 1, 0, 0, nullptr, 0) != 1)
+		return false;
+	unsigned nHead = *m_pCqHead;
+	if (nHead != __atomic_load_n(m_pCqTail, __ATOMIC_ACQUIRE))
 	{
-		for (auto &hostPair : m_pRedisServ->m_vecHosts)
+		struct io_uring_cqe *pCqe = &static_cast<struct io_uring_cqe *>(m_pCqes)[nHead & *m_pCqMask];
+		if (pCqe->user_data == s_nUringRecv && pCqe->res == -EINVAL)
 		{
-			if (ConnectToRedis(hostPair.first, hostPair.second, m_pRedisServ->m_nCliTimeout))
-			{
-				m_pRedisServ->m_strHost = hostPair.first;
-				m_pRedisServ->m_nPort = hostPair.second;
-				return true;
-			}
+			--m_nInFlight;
+			m_bRecvArmed = false;
+			__atomic_store_n(m_pCqHead, nHead + 1, __ATOMIC_RELEASE);
+			return false;
 		}
 	}
+	return true;
+}
 
-    m_pRedisServ->m_strHost.clear();
-    return false;
+// the kernel picks a free buffer of the registered ring for every chunk it receives
+bool CUringRing::SetupBuffer()
+{
+	m_pBufRing = mmap(nullptr, m_nBufNum * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (m_pBufRing == MAP_FAILED)
+	{
+		m_pBufRing = nullptr;
+		return false;
+	}
+	m_pBufMem = new char[static_cast<size_t>(m_nBufNum) * URING_BUF_SIZE];
+	m_nBufTail = 0;
+	struct io_uring_buf_reg bufReg;
+	memset(&bufReg, 0, sizeof(bufReg));
+	bufReg.ring_addr = reinterpret_cast<uint64_t>(m_pBufRing);
+	bufReg.ring_entries = m_nBufNum;
+	bufReg.bgid = 0;
+	if (syscall(__NR_io_uring_register, m_nRing, IORING_REGISTER_PBUF_RING, &bufReg, 1) != 0)
+		return false;
+	for (uint16_t i = 0; i < m_nBufNum; ++i)
+		RecycleBuffer(i);
+	return true;
 }
 
-// CRedisServer methods
-CRedisServer::CRedisServer(const std::string &strHost, int nPort, int nClientTimeout, int nServerTimeout, int nConnNum)
-    : m_strHost(strHost), m_nPort(nPort), m_nCliTimeout(nClientTimeout), m_nSerTimeout(nServerTimeout), m_nConnNum(nConnNum)
+// a connection whose replies keep running the ring dry gets twice the buffers, up to URING_BUF_MAX. only
+// called while no receive is armed, every buffer is back in the ring by then
+bool CUringRing::GrowBuffer()
 {
-	SetSlave(strHost, nPort);
-    Initialize();
+	struct io_uring_buf_reg bufReg;
+	memset(&bufReg, 0, sizeof(bufReg));
+	bufReg.bgid = 0;
+	if (m_nBufNum >= URING_BUF_MAX || syscall(__NR_io_uring_register, m_nRing, IORING_UNREGISTER_PBUF_RING, &bufReg, 1) != 0)
+		return true;
+	munmap(m_pBufRing, m_nBufNum * sizeof(struct io_uring_buf));
+	delete[] m_pBufMem;
+	m_pBufRing = nullptr;
+	m_pBufMem = nullptr;
+	m_nBufNum *= 2;
+	return SetupBuffer();
 }
 
-CRedisServer::~CRedisServer()
+void CUringRing::RecycleBuffer(uint16_t nBid)
 {
-    CleanConn();
+	// io_uring_buf_ring is not used since its flexible array shifts the entries in c++. the ring tail
+	// overlays the reserved field of the first entry
+	struct io_uring_buf *pBufs = static_cast<struct io_uring_buf *>(m_pBufRing);
+	struct io_uring_buf *pBuf = &pBufs[m_nBufTail & (m_nBufNum - 1)];
+	pBuf->addr = reinterpret_cast<uint64_t>(m_pBufMem + static_cast<size_t>(nBid) * URING_BUF_SIZE);
+	pBuf->len = URING_BUF_SIZE;
+	pBuf->bid = nBid;
+	++m_nBufTail;
+	__atomic_store_n(&pBufs[0].resv, m_nBufTail, __ATOMIC_RELEASE);
 }
 
-void CRedisServer::CleanConn()
+void CUringRing::QueueSend()
 {
-	std::lock_guard<std::mutex> guard(m_mutexConn);
-    while (!m_queIdleConn.empty())
-    {
-        delete m_queIdleConn.front();
-        m_queIdleConn.pop();
-    }
+	unsigned nIdx = *m_pSqTail & *m_pSqMask;
+	struct io_uring_sqe *pSqe = &static_cast<struct io_uring_sqe *>(m_pSqes)[nIdx];
+	memset(pSqe, 0, sizeof(*pSqe));
+	pSqe->opcode = IORING_OP_SEND;
+	pSqe->fd = m_nFd;
+	pSqe->addr = reinterpret_cast<uint64_t>(m_strSend.data() + m_nSendOff);
+	pSqe->len = static_cast<uint32_t>(m_strSend.size() - m_nSendOff);
+	pSqe->msg_flags = MSG_NOSIGNAL;
+	pSqe->user_data = s_nUringSend;
+	m_pSqArray[nIdx] = nIdx;
+	__atomic_store_n(m_pSqTail, *m_pSqTail + 1, __ATOMIC_RELEASE);
+	++m_nInFlight;
 }
 
-void CRedisServer::SetSlave(const std::string &strHost, int nPort)
+// one multishot receive delivers every chunk until it runs out of buffers or the peer closes
+void CUringRing::QueueRecv()
 {
-    m_vecHosts.push_back(std::make_pair(strHost, nPort));
+	unsigned nIdx = *m_pSqTail & *m_pSqMask;
+	struct io_uring_sqe *pSqe = &static_cast<struct io_uring_sqe *>(m_pSqes)[nIdx];
+	memset(pSqe, 0, sizeof(*pSqe));
+	pSqe->opcode = IORING_OP_RECV;
+	pSqe->fd = m_nFd;
+	pSqe->ioprio = IORING_RECV_MULTISHOT;
+	pSqe->flags = IOSQE_BUFFER_SELECT;
+	pSqe->buf_group = 0;
+	pSqe->user_data = s_nUringRecv;
+	m_pSqArray[nIdx] = nIdx;
+	__atomic_store_n(m_pSqTail, *m_pSqTail + 1, __ATOMIC_RELEASE);
+	++m_nInFlight;
+	m_bRecvArmed = true;
 }
 
-CRedisConnection * CRedisServer::FetchConnection()
+int CUringRing::Reap(redisContext *pContext)
 {
-	CRedisConnection *pRedisConn = nullptr;
-	
-#ifdef ENV_APPLY
-	std::unique_lock<std::mutex> guard(m_mutexConn);
-	_wait.wait_for(guard, std::chrono::milliseconds(100), [&]()-> bool {
-		return !(m_queIdleConn.empty()); 
-	});
-#else // ENV_APPLY
-	m_mutexConn.lock();
-#endif // ENV_APPLY
-	
-	if (!m_queIdleConn.empty())
+	int nErr = 0;
+	bool bDry = false;
+	unsigned nHead = *m_pCqHead;
+	for (unsigned nTail = __atomic_load_n(m_pCqTail, __ATOMIC_ACQUIRE); nHead != nTail; ++nHead)
 	{
-		pRedisConn = m_queIdleConn.front();
-		m_queIdleConn.pop();
+		struct io_uring_cqe *pCqe = &static_cast<struct io_uring_cqe *>(m_pCqes)[nHead & *m_pCqMask];
+		if (pCqe->user_data == s_nUringRecv)
+		{
+			if (pCqe->res > 0)
+			{
+				uint16_t nBid = static_cast<uint16_t>(pCqe->flags >> IORING_CQE_BUFFER_SHIFT);
+				redisReaderFeed(pContext->reader, m_pBufMem + static_cast<size_t>(nBid) * URING_BUF_SIZE, pCqe->res);
+				RecycleBuffer(nBid);
+			}
+			if (!(pCqe->flags & IORING_CQE_F_MORE))
+			{
+				// out of buffers only stops the receive, it is armed again below
+				--m_nInFlight;
+				m_bRecvArmed = false;
+				if (pCqe->res == 0)
+					nErr = -1;
+				else if (pCqe->res == -ENOBUFS)
+					bDry = true;
+				else if (pCqe->res < 0)
+					nErr = -pCqe->res;
+			}
+		}
+		else if (pCqe->user_data == s_nUringSend)
+		{
+			--m_nInFlight;
+			if (pCqe->res < 0)
+				nErr = -pCqe->res;
+			else if ((m_nSendOff += pCqe->res) < m_strSend.size())
+				QueueSend();
+		}
 	}
+	__atomic_store_n(m_pCqHead, nHead, __ATOMIC_RELEASE);
+
+	if (nErr == -1)
+		return Fail(pContext, REDIS_ERR_EOF, 0, "Server closed the connection");
+	if (nErr)
+		return Fail(pContext, REDIS_ERR_IO, nErr, strerror(nErr));
+	if (bDry && !m_bRecvArmed && !GrowBuffer())
+		return Fail(pContext, REDIS_ERR_IO, ENOMEM, strerror(ENOMEM));
+	if (!m_bRecvArmed)
+		QueueRecv();
+	return RC_SUCCESS;
+}
 
-#ifdef ENV_APPLY
-#else // ENV_APPLY
-	m_mutexConn.unlock();
-#endif // ENV_APPLY
+int CUringRing::Request(redisContext *pContext, const char *pszCmd, size_t nLen, redisReply **ppReply)
+{
+	*ppReply = nullptr;
+	m_strSend.assign(pszCmd ? pszCmd : "", nLen);
+	m_nSendOff = 0;
+	if (nLen > 0)
+		QueueSend();
+	if (!m_bRecvArmed)
+		QueueRecv();
+
+	int64_t nEnd = m_nTimeout > 0 ? SteadyMs() + m_nTimeout : 0;
+	while (true)
+	{
+		// the reply is only taken once the kernel is done with the send buffer
+		if (m_nSendOff == m_strSend.size())
+		{
+			void *pReply = nullptr;
+			if (redisReaderGetReply(pContext->reader, &pReply) != REDIS_OK)
+				return Fail(pContext, REDIS_ERR_PROTOCOL, 0, "Protocol error");
+			if (pReply)
+			{
+				*ppReply = static_cast<redisReply *>(pReply);
+				return RC_SUCCESS;
+			}
+		}
 
-	return pRedisConn;
+		struct __kernel_timespec tsWait = { 0, 0 };
+		struct io_uring_getevents_arg argWait;
+		memset(&argWait, 0, sizeof(argWait));
+		if (nEnd > 0)
+		{
+			int64_t nRemain = nEnd - SteadyMs();
+			if (nRemain <= 0)
+				return Fail(pContext, REDIS_ERR_IO, EAGAIN, "Resource temporarily unavailable");
+			tsWait.tv_sec = nRemain / 1000;
+			tsWait.tv_nsec = (nRemain % 1000) * 1000000;
+			argWait.ts = reinterpret_cast<uint64_t>(&tsWait);
+		}
+		unsigned nSubmit = *m_pSqTail - __atomic_load_n(m_pSqHead, __ATOMIC_ACQUIRE);
+		if (UringEnter(m_nRing, nSubmit, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &argWait, sizeof(argWait)) < 0 &&
+			errno != ETIME && errno != EINTR && errno != EBUSY)
+			return Fail(pContext, REDIS_ERR_IO, errno, strerror(errno));
+		if (Reap(pContext) != RC_SUCCESS)
+			return RC_RQST_ERR;
+	}
 }
 
-void CRedisServer::ReturnConnection(CRedisConnection *pRedisConn)
+int CUringRing::Fail(redisContext *pContext, int nErr, int nErrno, const char *pszMsg)
 {
-#ifdef ENV_APPLY
-	std::lock_guard<std::mutex> guard(m_mutexConn);
-#else // ENV_APPLY
-	m_mutexConn.lock();
-#endif // ENV_APPLY
+	pContext->err = nErr;
+	snprintf(pContext->errstr, sizeof(pContext->errstr), "%s", pszMsg);
+	errno = nErrno;
+	return RC_RQST_ERR;
+}
+#else
+CUringRing::~CUringRing() {}
+bool CUringRing::Init(int) { return false; }
+void CUringRing::RecycleBuffer(uint16_t) {}
+void CUringRing::QueueSend() {}
+void CUringRing::QueueRecv() {}
+int CUringRing::Reap(redisContext *) { return RC_NOT_SUPPORT; }
+int CUringRing::Request(redisContext *, const char *, size_t, redisReply **) { return RC_NOT_SUPPORT; }
+int CUringRing::Fail(redisContext *, int, int, const char *) { return RC_NOT_SUPPORT; }
+#endif
 
-    m_queIdleConn.push(pRedisConn);
+// CZeroCopy methods
+CZeroCopy::CZeroCopy()
+	: m_nFd(-1), m_nMinSize(0), m_nNextId(0), m_nDoneId(0), m_bCopied(false), m_pnSend(nullptr), m_pnCopied(nullptr)
+{
+}
 
-#ifdef ENV_APPLY
-	_wait.notify_one();
-#else // ENV_APPLY
-	m_mutexConn.unlock();
-#endif // ENV_APPLY
+#ifdef ZEROCOPY_SUPPORTED
+// a buffer still queued after the wait may yet be read by the kernel, it is leaked instead of freed
+CZeroCopy::~CZeroCopy()
+{
+	Reap(ZEROCOPY_WAIT_MS);
 }
 
-bool CRedisServer::Initialize()
+bool CZeroCopy::Init(int nFd, int nMinSize, std::atomic<int64_t> *pnSend, std::atomic<int64_t> *pnCopied)
 {
-	CleanConn();
+	int nOn = 1;
+	if (setsockopt(nFd, SOL_SOCKET, SO_ZEROCOPY, &nOn, sizeof(nOn)) != 0)
+		return false;
+	m_nFd = nFd;
+	m_nMinSize = static_cast<size_t>(nMinSize);
+	m_pnSend = pnSend;
+	m_pnCopied = pnCopied;
+	return true;
+}
 
-	for (int i = 0; i < m_nConnNum; ++i)
+int CZeroCopy::Send(redisContext *pContext, char *pszCmd, int nLen)
+{
+	if (m_queBuffer.size() >= ZEROCOPY_PENDING_MAX)
+		Reap(ZEROCOPY_WAIT_MS);
+
+	int nFlags = MSG_NOSIGNAL | (m_bCopied ? 0 : MSG_ZEROCOPY);
+	uint32_t nFirstId = m_nNextId;
+	int nOff = 0;
+	int nErrno = 0;
+	while (nOff < nLen)
 	{
-		auto pRedisConn = std::make_unique<CRedisConnection>(this);
-		if (pRedisConn->IsValid())
-			m_queIdleConn.push(pRedisConn.release());
+		ssize_t nSent = send(m_nFd, pszCmd + nOff, nLen - nOff, nFlags);
+		if (nSent >= 0)
+		{
+			// every zerocopy send gets one completion id, partial ones too
+			if (nFlags & MSG_ZEROCOPY)
+				++m_nNextId;
+			nOff += static_cast<int>(nSent);
+		}
+		else if (errno == ENOBUFS && (nFlags & MSG_ZEROCOPY))
+			nFlags &= ~MSG_ZEROCOPY;	// the pinned pages exceed optmem_max, the rest is copied
+		else if (errno != EINTR)
+		{
+			nErrno = errno;
+			break;
+		}
 	}
 
-    return !m_queIdleConn.empty();
+	if (m_nNextId != nFirstId)
+	{
+		m_queBuffer.push(std::make_pair(m_nNextId, pszCmd));
+		++*m_pnSend;
+	}
+	else
+		redisFreeCommand(pszCmd);
+
+	if (nOff == nLen)
+		return RC_SUCCESS;
+	pContext->err = REDIS_ERR_IO;
+	snprintf(pContext->errstr, sizeof(pContext->errstr), "%s", strerror(nErrno));
+	errno = nErrno;
+	return RC_RQST_ERR;
 }
 
-int CRedisServer::ServRequest(CRedisCommand *pRedisCmd)
+void CZeroCopy::Reap(int nWaitMs)
 {
-    CRedisConnection *pRedisConn = nullptr;
-    int nTry = RQST_RETRY_TIMES;
-    while (nTry--)
-    {
-        if ((pRedisConn = FetchConnection()))
-            break;
-        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	int64_t nEnd = SteadyMs() + nWaitMs;
+	while (!m_queBuffer.empty())
+	{
+		char szControl[128];
+		struct msghdr msgErr;
+		memset(&msgErr, 0, sizeof(msgErr));
+		msgErr.msg_control = szControl;
+		msgErr.msg_controllen = sizeof(szControl);
+		if (recvmsg(m_nFd, &msgErr, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			int nRemain = static_cast<int>(nEnd - SteadyMs());
+			if ((errno != EAGAIN && errno != EWOULDBLOCK) || nRemain <= 0)
+				break;
+			// a completion on the error queue shows up as POLLERR
+			struct pollfd pollErr = { m_nFd, 0, 0 };
+			if (poll(&pollErr, 1, nRemain) < 0 || (pollErr.revents & (POLLHUP | POLLNVAL)))
+				break;
+			continue;
+		}
+
+		for (struct cmsghdr *pCmsg = CMSG_FIRSTHDR(&msgErr); pCmsg; pCmsg = CMSG_NXTHDR(&msgErr, pCmsg))
+		{
+			if (!(pCmsg->cmsg_level == SOL_IP && pCmsg->cmsg_type == IP_RECVERR) &&
+				!(pCmsg->cmsg_level == SOL_IPV6 && pCmsg->cmsg_type == IPV6_RECVERR))
+				continue;
+			struct sock_extended_err *pErr = reinterpret_cast<struct sock_extended_err *>(CMSG_DATA(pCmsg));
+			if (pErr->ee_errno != 0 || pErr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+				continue;
+			// tcp completes in order, ee_data is the last id of the range
+			m_nDoneId = pErr->ee_data + 1;
+			if ((pErr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) && !m_bCopied)
+			{
+				m_bCopied = true;
+				++*m_pnCopied;
+			}
+		}
+		while (!m_queBuffer.empty() && static_cast<int32_t>(m_nDoneId - m_queBuffer.front().first) >= 0)
+		{
+			redisFreeCommand(m_queBuffer.front().second);
+			m_queBuffer.pop();
+		}
+	}
+}
+#else
+CZeroCopy::~CZeroCopy() {}
+bool CZeroCopy::Init(int, int, std::atomic<int64_t> *, std::atomic<int64_t> *) { return false; }
+int CZeroCopy::Send(redisContext *, char *pszCmd, int) { redisFreeCommand(pszCmd); return RC_NOT_SUPPORT; }
+void CZeroCopy::Reap(int) {}
+#endif
+
+// CRedisConnection methods
+CRedisConnection::CRedisConnection(CRedisServer *pRedisServ)
+    : m_pContext(nullptr), m_nUseTime(0), m_pRedisServ(pRedisServ), m_nReadTimeout(-1), m_nWriteTimeout(-1),
+      m_pUring(nullptr), m_pZeroCopy(nullptr), m_nPriority(-1)
+{
+    m_arrApplied[0] = m_arrApplied[1] = -1;
+    Reconnect();
+}
+CRedisConnection::~CRedisConnection()
+{
+    CloseContext();
+//	delete m_pRedisServ;
+//	m_pRedisServ = nullptr;
+}
+int CRedisConnection::ConnRequest(CRedisCommand *pRedisCmd)
+{
+	if (!EnsureContext())
+		return RC_RQST_ERR;
+	int64_t nIdle = SteadyMs() - m_nUseTime;
+
+    // the deadline shortens the socket timeouts of this request only
+    int nTimeout = pRedisCmd->GetTimeout();
+    const CDeadline &deadline = pRedisCmd->GetDeadline();
+    if (deadline.IsSet())
+    {
+        int nRemain = deadline.RemainMs();
+        if (nRemain <= 0)
+            return RC_TIMEOUT;
+        int nSocket = nTimeout >= 0 ? nTimeout : std::min(m_nReadTimeout > 0 ? m_nReadTimeout : m_pRedisServ->m_nReadTimeout,
+                                                          m_nWriteTimeout > 0 ? m_nWriteTimeout : m_pRedisServ->m_nWriteTimeout);
+        if (nSocket <= 0 || nRemain < nSocket)
+            nTimeout = nRemain;
+    }
+    // the timeouts stay on the socket, the next request only changes them when it needs others
+    int nRet = RC_RQST_ERR;
+    for (int nTry = 0; nTry < 2; ++nTry)
+    {
+        if (!EnsureContext())
+            return RC_RQST_ERR;
+        if (nTimeout >= 0)
+            ApplyTimeout(nTimeout, nTimeout);
+        else
+            ApplyTimeout(m_nReadTimeout, m_nWriteTimeout);
+        nRet = pRedisCmd->CmdRequest(m_pContext, m_pUring, m_pZeroCopy);
+        if (nRet != RC_RQST_ERR)
+            break;
+
+        // the server closes connections idle longer than its timeout without reading the command,
+        // such a connection gets one fresh attempt (without the keep-alive sweeper this is the usual case)
+        bool bIdleClosed = nTry == 0 && m_pContext && m_pContext->err == REDIS_ERR_EOF &&
+            nIdle >= m_pRedisServ->m_nSerTimeout * 1000LL;
+        if (CheckBroken())
+            return RC_TIMEOUT;
+        if (!bIdleClosed)
+            return nRet;
+    }
+
+    m_nUseTime = SteadyMs();
+    return nRet;
+}
+
+// PING on behalf of the keep-alive sweeper, a failed connection is closed
+bool CRedisConnection::Ping()
+{
+    if (!m_pContext)
+        return false;
+
+    CRedisCommand redisCmd("PING");
+    ApplyTimeout(m_nReadTimeout, m_nWriteTimeout);
+    if (redisCmd.CmdRequest(m_pContext, m_pUring) != RC_SUCCESS || redisCmd.GetReply()->type != REDIS_REPLY_STATUS)
+    {
+        CloseContext();
+        return false;
+    }
+    m_nUseTime = SteadyMs();
+    return true;
+}
+
+int CRedisConnection::ConnRequest(std::vector<CRedisCommand *> &vecRedisCmd)
+{
+    if (!EnsureContext())
+        return RC_RQST_ERR;
+
+    int nRet = RC_SUCCESS;
+    ApplyTimeout(m_nReadTimeout, m_nWriteTimeout);
+    //for (size_t i = 0; i < vecRedisCmd.size() && nRet == RC_SUCCESS; ++i)
+    //    nRet = vecRedisCmd[i]->CmdAppend(m_pContext);
+    for (size_t i = 0; i < vecRedisCmd.size() && nRet == RC_SUCCESS; ++i)
+        nRet = vecRedisCmd[i]->CmdReply(m_pContext, m_pUring);
+    if (nRet == RC_RQST_ERR && CheckBroken())
+        nRet = RC_TIMEOUT;
+    return nRet;
+}
+
+void CRedisConnection::SetTimeout(int nReadMs, int nWriteMs)
+{
+    m_nReadTimeout = nReadMs;
+    m_nWriteTimeout = nWriteMs;
+    ApplyTimeout(nReadMs, nWriteMs);
+}
+
+void CRedisConnection::ApplyTimeout(int nReadMs, int nWriteMs)
+{
+    if (!m_pContext)
+        return;
+
+    // 0 would make the socket wait forever
+    int arrTimeout[2] = { nReadMs > 0 ? nReadMs : m_pRedisServ->m_nReadTimeout,
+                          nWriteMs > 0 ? nWriteMs : m_pRedisServ->m_nWriteTimeout };
+    // io_uring ignores the socket timeouts, the ring waits for the reply itself
+    if (m_pUring)
+        m_pUring->SetTimeout(arrTimeout[0]);
+    int arrOpt[2] = { SO_RCVTIMEO, SO_SNDTIMEO };
+    for (int i = 0; i < 2; ++i)
+    {
+        // a request with a deadline would otherwise cost setsockopt calls every time
+        if (arrTimeout[i] == m_arrApplied[i])
+            continue;
+        m_arrApplied[i] = arrTimeout[i];
+#if defined(_WIN32)
+        DWORD dwTimeout = static_cast<DWORD>(arrTimeout[i]);
+        setsockopt(m_pContext->fd, SOL_SOCKET, arrOpt[i], reinterpret_cast<const char *>(&dwTimeout), sizeof(dwTimeout));
+#else
+        struct timeval tmTimeout = { arrTimeout[i] / 1000, (arrTimeout[i] % 1000) * 1000 };
+        setsockopt(m_pContext->fd, SOL_SOCKET, arrOpt[i], &tmTimeout, sizeof(tmTimeout));
+#endif
+    }
+}
+
+// options refused by the system are skipped, the connection works with the defaults
+static void ApplySocketOpt(redisContext *pContext, const RedisSocketOpt &socketOpt, bool bUnix)
+{
+    auto funcSet = [pContext](int nLevel, int nOpt, int nVal) {
+        setsockopt(pContext->fd, nLevel, nOpt, reinterpret_cast<const char *>(&nVal), sizeof(nVal));
+    };
+
+    if (socketOpt.nSendBuf > 0)
+        funcSet(SOL_SOCKET, SO_SNDBUF, socketOpt.nSendBuf);
+    if (socketOpt.nRecvBuf > 0)
+        funcSet(SOL_SOCKET, SO_RCVBUF, socketOpt.nRecvBuf);
+#ifdef SO_BUSY_POLL
+    if (socketOpt.nBusyPollUs > 0)
+        funcSet(SOL_SOCKET, SO_BUSY_POLL, socketOpt.nBusyPollUs);
+#endif
+    // hiredis flags the context as failed when a unix socket refuses its keep-alive options
+    if (bUnix)
+        return;
+
+    funcSet(IPPROTO_TCP, TCP_NODELAY, socketOpt.bNoDelay ? 1 : 0);
+#ifdef IP_TOS
+    if (socketOpt.nTos >= 0)
+        funcSet(IPPROTO_IP, IP_TOS, socketOpt.nTos);
+#endif
+    // TCP keep-alive notices peers which vanished without a FIN, the sweeper handles the rest
+    if (socketOpt.nKeepAliveSec < 0)
+        redisEnableKeepAlive(pContext);
+    else if (socketOpt.nKeepAliveSec > 0)
+        redisEnableKeepAliveWithInterval(pContext, socketOpt.nKeepAliveSec);
+}
+
+// hiredis leaves the context unusable after an I/O error or a timeout (a reply may still be on the way),
+// the connection is closed so that the pool drops it instead of lending it out again. true on a timeout
+bool CRedisConnection::CheckBroken()
+{
+    if (!m_pContext || !m_pContext->err)
+        return false;
+
+#ifdef REDIS_ERR_TIMEOUT
+    bool bTimeout = m_pContext->err == REDIS_ERR_TIMEOUT;
+#else
+    bool bTimeout = false;
+#endif
+    bTimeout = bTimeout || (m_pContext->err == REDIS_ERR_IO && (errno == EAGAIN || errno == EWOULDBLOCK || errno == ETIMEDOUT));
+    CloseContext();
+    return bTimeout;
+}
+
+// the ring and the zerocopy buffers go first, both need the socket to settle what the kernel still holds
+void CRedisConnection::CloseContext()
+{
+    if (m_pUring)
+    {
+        delete m_pUring;
+        m_pUring = nullptr;
+        --m_pRedisServ->m_nUringConn;
+    }
+    if (m_pZeroCopy)
+    {
+        delete m_pZeroCopy;
+        m_pZeroCopy = nullptr;
+    }
+    if (m_pContext)
+    {
+        redisFree(m_pContext);
+        m_pContext = nullptr;
+    }
+    m_arrApplied[0] = m_arrApplied[1] = -1;
+}
+
+bool CRedisConnection::ConnectToRedis(const std::string &strHost, int nPort, int nTimeout)
+{
+	CloseContext();
+
+    struct timeval tmTimeout = { nTimeout / 1000, (nTimeout % 1000) * 1000 };
+    bool bUnix = IsUnixHost(strHost);
+#if defined(_WIN32)
+    if (bUnix)
+        return false;
+    m_pContext = redisConnectWithTimeout(strHost.c_str(), nPort, tmTimeout);
+#else
+    if (bUnix)
+        m_pContext = redisConnectUnixWithTimeout(strHost.c_str() + sizeof(s_szUnixPrefix) - 1, tmTimeout);
+    else
+        m_pContext = redisConnectWithTimeout(strHost.c_str(), nPort, tmTimeout);
+#endif
+    if (!m_pContext || m_pContext->err)
+    {
+        if (m_pContext)
+        {
+            redisFree(m_pContext);
+            m_pContext = nullptr;
+        }
+        return false;
+    }
+
+    ApplyTimeout(m_nReadTimeout, m_nWriteTimeout);
+    ApplySocketOpt(m_pContext, m_pRedisServ->m_socketOpt, bUnix);
+    if (!Handshake())
+    {
+        CloseContext();
+        return false;
+    }
+
+    // the handshake ran on the plain socket, from here on the ring owns every read
+    if (m_pRedisServ->m_socketOpt.bUring)
+    {
+        m_pUring = new CUringRing;
+        if (m_pUring->Init(m_pContext->fd))
+        {
+            ++m_pRedisServ->m_nUringConn;
+            ApplyTimeout(m_nReadTimeout, m_nWriteTimeout);
+        }
+        else
+        {
+            delete m_pUring;
+            m_pUring = nullptr;
+        }
+    }
+    if (!m_pUring && !bUnix && m_pRedisServ->m_socketOpt.nZeroCopyMin > 0)
+    {
+        m_pZeroCopy = new CZeroCopy;
+        if (!m_pZeroCopy->Init(m_pContext->fd, m_pRedisServ->m_socketOpt.nZeroCopyMin,
+                               &m_pRedisServ->m_nZeroCopySend, &m_pRedisServ->m_nZeroCopyCopied))
+        {
+            delete m_pZeroCopy;
+            m_pZeroCopy = nullptr;
+        }
+    }
+    m_nUseTime = SteadyMs();
+    return true;
+}
+
+static void BuildHandshake(const RedisHandshake &redisHandshake, bool bReadOnly, std::vector<std::vector<std::string> > &vecCmd)
+{
+    if (redisHandshake.bHello)
+    {
+        // protocol 2 keeps the reply parsing of the pool unchanged
+        std::vector<std::string> vecHello = { "HELLO", "2" };
+        if (!redisHandshake.strPassword.empty())
+        {
+            vecHello.push_back("AUTH");
+            vecHello.push_back(redisHandshake.strUser.empty() ? "default" : redisHandshake.strUser);
+            vecHello.push_back(redisHandshake.strPassword);
+        }
+        if (!redisHandshake.strClientName.empty())
+        {
+            vecHello.push_back("SETNAME");
+            vecHello.push_back(redisHandshake.strClientName);
+        }
+        vecCmd.push_back(vecHello);
+    }
+    else
+    {
+        // AUTH without a user also works against servers older than 6
+        if (!redisHandshake.strPassword.empty() && redisHandshake.strUser.empty())
+            vecCmd.push_back({ "AUTH", redisHandshake.strPassword });
+        else if (!redisHandshake.strPassword.empty())
+            vecCmd.push_back({ "AUTH", redisHandshake.strUser, redisHandshake.strPassword });
+        if (!redisHandshake.strClientName.empty())
+            vecCmd.push_back({ "CLIENT", "SETNAME", redisHandshake.strClientName });
+    }
+    if (redisHandshake.nDb > 0)
+        vecCmd.push_back({ "SELECT", std::to_string(redisHandshake.nDb) });
+    // replica connections in cluster mode must be switched to readonly or every read is MOVED
+    if (bReadOnly)
+        vecCmd.push_back({ "READONLY" });
+    for (auto &strCmd : redisHandshake.vecCommand)
+    {
+        std::istringstream issCmd(strCmd);
+        std::vector<std::string> vecArg((std::istream_iterator<std::string>(issCmd)), std::istream_iterator<std::string>());
+        if (!vecArg.empty())
+            vecCmd.push_back(vecArg);
+    }
+}
+
+// all handshake commands are written before the first reply is read, so a new connection
+// pays one round trip however many of them are configured
+bool CRedisConnection::Handshake()
+{
+    std::vector<std::vector<std::string> > vecCmd;
+    BuildHandshake(m_pRedisServ->m_redisHandshake, m_pRedisServ->m_bReadOnly, vecCmd);
+
+    for (auto &vecArg : vecCmd)
+    {
+        std::vector<const char *> vecPtr;
+        std::vector<size_t> vecLen;
+        for (auto &strArg : vecArg)
+        {
+            vecPtr.push_back(strArg.c_str());
+            vecLen.push_back(strArg.size());
+        }
+        if (redisAppendCommandArgv(m_pContext, static_cast<int>(vecArg.size()), vecPtr.data(), vecLen.data()) != REDIS_OK)
+            return false;
+    }
+
+    // every reply is read even after an error one, the caller frees the context either way
+    bool bOk = true;
+    for (size_t i = 0; i < vecCmd.size(); ++i)
+    {
+        redisReply *pReply = nullptr;
+        if (redisGetReply(m_pContext, (void **)&pReply) != REDIS_OK || !pReply)
+            return false;
+        bOk = bOk && pReply->type != REDIS_REPLY_ERROR;
+        freeReplyObject(pReply);
+    }
+    return bOk;
+}
+
+// the address is never cleared on failure. only a standalone master has replicas in m_vecHosts to fail
+// over to, cluster and shard nodes keep their own address
+bool CRedisConnection::Reconnect()
+{
+	std::string strHost = m_pRedisServ->GetHost();
+	int nPort = m_pRedisServ->GetPort();
+	if (ConnectToRedis(strHost, nPort, m_pRedisServ->m_nConnectTimeout))
+		return true;
+
+	for (auto &hostPair : m_pRedisServ->GetHosts())
+	{
+		if (hostPair == std::make_pair(strHost, nPort))
+			continue;
+		if (ConnectToRedis(hostPair.first, hostPair.second, m_pRedisServ->m_nConnectTimeout))
+		{
+			std::lock_guard<std::mutex> guard(m_pRedisServ->m_mutexHost);
+			m_pRedisServ->m_strHost = hostPair.first;
+			m_pRedisServ->m_nPort = hostPair.second;
+			return true;
+		}
+	}
+	return false;
+}
+
+// a connection lost under a pinned caller reconnects once, a dead node is left to the
+// reconnector instead of every caller paying the connect timeout
+bool CRedisConnection::EnsureContext()
+{
+    if (m_pContext)
+        return true;
+    if (m_pRedisServ->IsDown())
+        return false;
+    if (Reconnect())
+        return true;
+    m_pRedisServ->MarkDown();
+    return false;
+}
+
+// CInFlight methods
+bool CInFlight::Acquire(int64_t nBytes, int nWaitMs)
+{
+	if (!IsLimited())
+		return true;
+
+	std::unique_lock<std::mutex> guard(m_mutexFlight);
+	auto funcRoom = [this, nBytes]() {
+		return (m_nMaxNum <= 0 || m_nNum < m_nMaxNum) && (m_nMaxBytes <= 0 || m_nBytes + nBytes <= m_nMaxBytes || m_nNum == 0);
+	};
+	if (!funcRoom())
+	{
+		++m_nLimitNum;
+		if (nWaitMs <= 0 || !m_condFlight.wait_for(guard, std::chrono::milliseconds(nWaitMs), funcRoom))
+		{
+			++m_nRejectNum;
+			return false;
+		}
+	}
+	++m_nNum;
+	m_nBytes += nBytes;
+	return true;
+}
+
+void CInFlight::Release(int64_t nBytes)
+{
+	if (!IsLimited())
+		return;
+	{
+		std::lock_guard<std::mutex> guard(m_mutexFlight);
+		--m_nNum;
+		m_nBytes -= nBytes;
+	}
+	// waiters need different amounts of room, each checks for itself
+	m_condFlight.notify_all();
+}
+
+void CInFlight::AddStat(RedisStat *pStat, bool bInFlight)
+{
+	std::lock_guard<std::mutex> guard(m_mutexFlight);
+	if (bInFlight)
+		pStat->nInFlight = m_nNum;
+	pStat->nLimitNum += m_nLimitNum;
+	pStat->nRejectNum += m_nRejectNum;
+}
+
+// room with the client and then with the node, the same order everywhere. how long it waits depends on the mode
+static int AcquireFlight(CInFlight *pClient, CInFlight *pNode, int64_t nBytes, int nPriority, const RedisLimit &redisLimit,
+	const CDeadline &deadline)
+{
+	bool bWait = redisLimit.nMode == LIMIT_BLOCK || (redisLimit.nMode == LIMIT_SHED && nPriority < PRIO_BULK);
+	CDeadline waitEnd = !bWait ? CDeadline::After(0) : (deadline.IsSet() ? deadline : CDeadline::After(redisLimit.nWaitMs));
+	if (!pClient || pClient->Acquire(nBytes, waitEnd.RemainMs()))
+	{
+		if (!pNode || pNode->Acquire(nBytes, waitEnd.RemainMs()))
+			return RC_SUCCESS;
+		if (pClient)
+			pClient->Release(nBytes);
+	}
+	return deadline.Expired() ? RC_TIMEOUT : RC_NO_RESOURCE;
+}
+
+static void ReleaseFlight(CInFlight *pClient, CInFlight *pNode, int64_t nBytes)
+{
+	if (pNode)
+		pNode->Release(nBytes);
+	if (pClient)
+		pClient->Release(nBytes);
+}
+
+// CRedisServer methods
+CRedisServer::CRedisServer(const std::string &strHost, int nPort, int nClientTimeout, int nServerTimeout, int nConnNum,
+                           bool bReadOnly, int nMinIdle, const RedisTimeout &redisTimeout,
+                           const RedisHandshake &redisHandshake, const RedisSocketOpt &socketOpt,
+                           const RedisLimit &redisLimit, const std::shared_ptr<CInFlight> &pClientFlight)
+    : m_strHost(strHost), m_nPort(nPort), m_nCliTimeout(nClientTimeout), m_nSerTimeout(nServerTimeout),
+      m_nConnectTimeout(redisTimeout.nConnectMs >= 0 ? redisTimeout.nConnectMs : nClientTimeout * 1000),
+      m_nReadTimeout(redisTimeout.nReadMs > 0 ? redisTimeout.nReadMs : nClientTimeout * 1000),
+      m_nWriteTimeout(redisTimeout.nWriteMs > 0 ? redisTimeout.nWriteMs : nClientTimeout * 1000),
+      m_nConnNum(nConnNum), m_bReadOnly(bReadOnly), m_nMinIdle(nMinIdle),
+      m_redisHandshake(redisHandshake), m_socketOpt(socketOpt), m_redisLimit(redisLimit),
+      m_pInFlight(std::make_shared<CInFlight>()), m_pClientFlight(pClientFlight), m_nConnCount(0),
+      m_nConnPeak(0), m_nGrowNum(0), m_nShrinkNum(0), m_nWaitNum(0), m_nExhaustNum(0),
+      m_bDown(false), m_nUringConn(0), m_nZeroCopySend(0), m_nZeroCopyCopied(0), m_bRetired(false), m_nBackoffMs(RECONN_BACKOFF_MIN), m_nProbeTime(0)
+{
+	m_pInFlight->Reset(redisLimit.nNodeNum, redisLimit.nNodeBytes);
+	// a reserve of the whole pool would starve PRIO_NORMAL and PRIO_BULK
+	m_redisLimit.nHighReserve = std::max(0, std::min(m_redisLimit.nHighReserve, nConnNum - 1));
+	for (int i = 0; i < PRIO_NUM; ++i)
+		m_arrBusy[i] = m_arrWait[i] = 0;
+	SetSlave(strHost, nPort);
+    Initialize();
+}
+
+CRedisServer::~CRedisServer()
+{
+    CleanConn();
+}
+
+void CRedisServer::CleanConn()
+{
+	std::lock_guard<std::mutex> guard(m_mutexConn);
+    while (!m_queIdleConn.empty())
+    {
+        delete m_queIdleConn.front();
+        m_queIdleConn.pop();
+        --m_nConnCount;
     }
+}
+
+void CRedisServer::Retire()
+{
+	{
+		std::lock_guard<std::mutex> guard(m_mutexConn);
+		m_bRetired = true;
+	}
+	CleanConn();
+}
+
+void CRedisServer::SetSlave(const std::string &strHost, int nPort)
+{
+	std::lock_guard<std::mutex> guard(m_mutexHost);
+	// every refresh reports the replicas again
+	auto hostPair = std::make_pair(strHost, nPort);
+	if (std::find(m_vecHosts.begin(), m_vecHosts.end(), hostPair) == m_vecHosts.end())
+		m_vecHosts.push_back(hostPair);
+}
+
+std::string CRedisServer::GetHost() const
+{
+	std::lock_guard<std::mutex> guard(m_mutexHost);
+	return m_strHost;
+}
+
+int CRedisServer::GetPort() const
+{
+	std::lock_guard<std::mutex> guard(m_mutexHost);
+	return m_nPort;
+}
+
+std::vector<std::pair<std::string, int> > CRedisServer::GetHosts() const
+{
+	std::lock_guard<std::mutex> guard(m_mutexHost);
+	return m_vecHosts;
+}
+
+// an empty pool below nConnNum opens one more connection, a full one waits up to nWaitMs
+// for a connection to come back
+CRedisConnection * CRedisServer::FetchConnection(int nWaitMs, int nPriority)
+{
+	CRedisConnection *pRedisConn = nullptr;
+	bool bGrow = false;
+	nPriority = std::max(PRIO_HIGH, std::min(nPriority, PRIO_BULK));
+	{
+		std::unique_lock<std::mutex> guard(m_mutexConn);
+		auto funcReady = [this, nPriority]() { return LaneFree(nPriority) || m_bDown; };
+		if (!funcReady() && nWaitMs > 0)
+		{
+			++m_nWaitNum;
+			++m_arrWait[nPriority];
+			if (!_wait.wait_for(guard, std::chrono::milliseconds(nWaitMs), funcReady))
+				++m_nExhaustNum;
+			--m_arrWait[nPriority];
+		}
+
+		if (LaneFree(nPriority))
+		{
+			if (!m_queIdleConn.empty())
+			{
+				pRedisConn = m_queIdleConn.front();
+				m_queIdleConn.pop();
+			}
+			else if (m_nConnCount < m_nConnNum && !m_bDown)
+			{
+				// reserve the slot now, connect outside the lock
+				m_nConnPeak = std::max(m_nConnPeak, ++m_nConnCount);
+				bGrow = true;
+			}
+			if (pRedisConn || bGrow)
+				++m_arrBusy[nPriority];
+		}
+	}
+
+	if (bGrow)
+	{
+		pRedisConn = new CRedisConnection(this);
+		if (pRedisConn->IsValid())
+			++m_nGrowNum;
+		else
+		{
+			delete pRedisConn;
+			pRedisConn = nullptr;
+			{
+				std::lock_guard<std::mutex> guard(m_mutexConn);
+				--m_nConnCount;
+				--m_arrBusy[nPriority];
+			}
+			MarkDown();
+		}
+	}
+	if (pRedisConn)
+		pRedisConn->m_nPriority = nPriority;
+	return pRedisConn;
+}
+
+// caller holds m_mutexConn. PRIO_HIGH may take any connection, the others leave nHighReserve free and
+// step back while a higher priority waits, PRIO_BULK also stays under nBulkConn
+bool CRedisServer::LaneFree(int nPriority) const
+{
+	int nFree = static_cast<int>(m_queIdleConn.size()) + (m_bDown ? 0 : std::max(0, m_nConnNum - m_nConnCount));
+	if (nPriority == PRIO_HIGH)
+		return nFree > 0;
+	if (nFree <= m_redisLimit.nHighReserve || m_arrWait[PRIO_HIGH] > 0)
+		return false;
+	if (nPriority == PRIO_NORMAL)
+		return true;
+	return m_arrWait[PRIO_NORMAL] == 0 && (m_redisLimit.nBulkConn <= 0 || m_arrBusy[PRIO_BULK] < m_redisLimit.nBulkConn);
+}
+
+// caller holds m_mutexConn
+void CRedisServer::BeginBackoff()
+{
+	if (m_bDown)
+		return;
+	m_bDown = true;
+	m_nBackoffMs = RECONN_BACKOFF_MIN;
+	m_nProbeTime = SteadyMs() + JitterMs(m_nBackoffMs);
+}
+
+void CRedisServer::MarkDown()
+{
+	std::lock_guard<std::mutex> guard(m_mutexConn);
+	BeginBackoff();
+	// callers waiting for a connection give up at once
+	_wait.notify_all();
+}
+
+// one reconnect attempt of a down node when its backoff has passed, called by the reconnector
+// only. returns when the next attempt is due, 0 once the node is up
+int64_t CRedisServer::Probe(int64_t nNowMs)
+{
+	{
+		std::lock_guard<std::mutex> guard(m_mutexConn);
+		if (!m_bDown)
+			return 0;
+		if (nNowMs < m_nProbeTime)
+			return m_nProbeTime;
+	}
+
+	CRedisConnection *pRedisConn = new CRedisConnection(this);
+	std::lock_guard<std::mutex> guard(m_mutexConn);
+	if (!pRedisConn->IsValid())
+	{
+		delete pRedisConn;
+		m_nBackoffMs = std::min(m_nBackoffMs * 2, RECONN_BACKOFF_MAX);
+		m_nProbeTime = SteadyMs() + JitterMs(m_nBackoffMs);
+		return m_nProbeTime;
+	}
+
+	m_queIdleConn.push(pRedisConn);
+	m_nConnPeak = std::max(m_nConnPeak, ++m_nConnCount);
+	m_bDown = false;
+	_wait.notify_all();
+	return 0;
+}
+
+void CRedisServer::ReturnConnection(CRedisConnection *pRedisConn)
+{
+	std::lock_guard<std::mutex> guard(m_mutexConn);
+
+	if (pRedisConn->m_nPriority >= 0)
+	{
+		--m_arrBusy[pRedisConn->m_nPriority];
+		pRedisConn->m_nPriority = -1;
+	}
+	// a connection closed after a timeout or an I/O error frees its slot, FetchConnection opens a new one
+	if (pRedisConn->IsValid() && !m_bRetired)
+		m_queIdleConn.push(pRedisConn);
+	else
+	{
+		delete pRedisConn;
+		--m_nConnCount;
+	}
+	// a single wakeup could land on a lower priority which has to step back
+	if (m_arrWait[PRIO_HIGH] > 0 || m_arrWait[PRIO_BULK] > 0)
+		_wait.notify_all();
+	else
+		_wait.notify_one();
+}
+
+void CRedisServer::AddStat(RedisStat *pStat)
+{
+	std::lock_guard<std::mutex> guard(m_mutexConn);
+	pStat->nConnNum += m_nConnCount;
+	pStat->nIdleConn += static_cast<int>(m_queIdleConn.size());
+	pStat->nMaxConn += m_nConnNum;
+	pStat->nPeakConn += m_nConnPeak;
+	pStat->nGrowNum += m_nGrowNum;
+	pStat->nShrinkNum += m_nShrinkNum;
+	pStat->nWaitNum += m_nWaitNum;
+	pStat->nExhaustNum += m_nExhaustNum;
+	pStat->nBulkConn += m_arrBusy[PRIO_BULK];
+	pStat->nDownNum += m_bDown ? 1 : 0;
+	pStat->nUringConn += m_nUringConn;
+	pStat->nZeroCopySend += m_nZeroCopySend;
+	pStat->nZeroCopyCopied += m_nZeroCopyCopied;
+	m_pInFlight->AddStat(pStat, false);
+}
+
+// idle connections are PINGed outside the pool lock, a request finds them busy for that
+// moment and grows the pool or waits like for any other busy connection
+void CRedisServer::KeepAlive(int64_t nNowMs, int nPingIdleMs, int nEvictIdleMs)
+{
+	std::vector<CRedisConnection *> vecPing;
+	{
+		// IsValid needs one open connection even when nMinIdle is 0
+		int nFloor = std::max(1, m_nMinIdle);
+		std::lock_guard<std::mutex> guard(m_mutexConn);
+		for (size_t i = m_queIdleConn.size(); i > 0; --i)
+		{
+			CRedisConnection *pRedisConn = m_queIdleConn.front();
+			m_queIdleConn.pop();
+			int64_t nIdle = nNowMs - pRedisConn->GetUseTime();
+			if (nEvictIdleMs > 0 && nIdle >= nEvictIdleMs && m_nConnCount > nFloor)
+			{
+				delete pRedisConn;
+				--m_nConnCount;
+				++m_nShrinkNum;
+			}
+			else if (nPingIdleMs > 0 && nIdle >= nPingIdleMs)
+				vecPing.push_back(pRedisConn);
+			else
+				m_queIdleConn.push(pRedisConn);
+		}
+	}
+
+	for (auto pRedisConn : vecPing)
+	{
+		pRedisConn->Ping();
+		ReturnConnection(pRedisConn);
+	}
+}
+
+bool CRedisServer::Initialize()
+{
+	CleanConn();
+
+	// in lazy mode one connection still checks that the node is reachable
+	int nOpen = m_nMinIdle < 0 ? m_nConnNum : std::max(1, std::min(m_nMinIdle, m_nConnNum));
+
+	// hiredis can not turn a non-blocking context into a blocking one, so the blocking connects run on
+	// at most CONNECT_FANOUT threads. all nodes start at once, more would only flood the accept queues.
+	// a thread stops at its first failure, an unreachable node costs one connect timeout
+	int nThreads = std::min(nOpen, CONNECT_FANOUT);
+	std::vector<std::future<std::vector<CRedisConnection *> > > vecFuture;
+	for (int i = 0; i < nThreads; ++i)
+	{
+		int nCount = nOpen / nThreads + (i < nOpen % nThreads ? 1 : 0);
+		vecFuture.push_back(std::async(std::launch::async, [this, nCount]()
+		{
+			std::vector<CRedisConnection *> vecConn;
+			for (int j = 0; j < nCount; ++j)
+			{
+				vecConn.push_back(new CRedisConnection(this));
+				if (!vecConn.back()->IsValid())
+					break;
+			}
+			return vecConn;
+		}));
+	}
+
+	std::lock_guard<std::mutex> guard(m_mutexConn);
+	for (auto &futConn : vecFuture)
+	{
+		for (auto pConn : futConn.get())
+		{
+			std::unique_ptr<CRedisConnection> pRedisConn(pConn);
+			if (pRedisConn->IsValid())
+			{
+				m_queIdleConn.push(pRedisConn.release());
+				++m_nConnCount;
+			}
+		}
+	}
+	m_nConnPeak = std::max<int>(m_nConnPeak, m_nConnCount);
+
+	if (!m_queIdleConn.empty())
+		m_bDown = false;
+	else
+		BeginBackoff();
+	_wait.notify_all();
+    return !m_queIdleConn.empty();
+}
+
+int CRedisServer::ServRequest(CRedisCommand *pRedisCmd)
+{
+    int64_t nBytes = static_cast<int64_t>(pRedisCmd->GetSize());
+    int nRet = AcquireFlight(m_pClientFlight.get(), m_pInFlight.get(), nBytes, pRedisCmd->GetPriority(), m_redisLimit, pRedisCmd->GetDeadline());
+    if (nRet != RC_SUCCESS)
+        return nRet;
+    nRet = PoolRequest(pRedisCmd);
+    ReleaseFlight(m_pClientFlight.get(), m_pInFlight.get(), nBytes);
+    return nRet;
+}
+
+int CRedisServer::PoolRequest(CRedisCommand *pRedisCmd)
+{
+    CRedisConnection *pRedisConn = nullptr;
+    const CDeadline &deadline = pRedisCmd->GetDeadline();
+    int nTry = RQST_RETRY_TIMES;
+    while (nTry--)
+    {
+        if ((pRedisConn = FetchConnection(deadline.CapMs(100), pRedisCmd->GetPriority())))
+            break;
+        if (deadline.Expired())
+            return RC_TIMEOUT;
+        if (m_bDown)
+            return RC_RQST_ERR;
+    }
+
+    if (!pRedisConn)
+        return deadline.Expired() ? RC_TIMEOUT : RC_NO_RESOURCE;
+
+    int nRet = pRedisConn->ConnRequest(pRedisCmd);
+    ReturnConnection(pRedisConn);
+    return nRet;
+}
+
+int CRedisServer::ServRequest(CRedisConnection* connection, CRedisCommand *pRedisCmd)
+{
+	int64_t nBytes = static_cast<int64_t>(pRedisCmd->GetSize());
+	int nRet = AcquireFlight(m_pClientFlight.get(), m_pInFlight.get(), nBytes, pRedisCmd->GetPriority(), m_redisLimit, pRedisCmd->GetDeadline());
+	if (nRet != RC_SUCCESS)
+		return nRet;
+	nRet = connection->ConnRequest(pRedisCmd);
+	ReleaseFlight(m_pClientFlight.get(), m_pInFlight.get(), nBytes);
+	return nRet;
+}
+
+#if !defined(_WIN32)
+// CRWLock methods
+void CRWLock::WaitShared()
+{
+	while (!TryLockShared())
+	{
+		uint32_t nState = m_nState.load();
+		if ((nState & WRITER_BIT) || m_nWaitWriter > 0)
+			Sleep(nState);
+	}
+}
+
+void CRWLock::WaitExclusive()
+{
+	++m_nWaitWriter;
+	while (!TryLock())
+	{
+		uint32_t nState = m_nState.load();
+		if (nState != 0)
+			Sleep(nState);
+	}
+	--m_nWaitWriter;
+}
+
+// the sleeper count is raised before the state is checked by the kernel, an unlock which
+// changed the state after our load either sees the sleeper or makes the wait return at once
+void CRWLock::Sleep(uint32_t nState)
+{
+	++m_nSleeper;
+#if defined(linux) || defined(__linux) || defined(__linux__)
+	syscall(SYS_futex, reinterpret_cast<uint32_t *>(&m_nState), FUTEX_WAIT_PRIVATE, nState, nullptr, nullptr, 0);
+#else
+	if (m_nState.load() == nState)
+		std::this_thread::yield();
+#endif
+	--m_nSleeper;
+}
+
+void CRWLock::WakeAll()
+{
+#if defined(linux) || defined(__linux) || defined(__linux__)
+	syscall(SYS_futex, reinterpret_cast<uint32_t *>(&m_nState), FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+#endif
+}
+#endif
+
+// CRetryBudget methods
+void CRetryBudget::Reset(double dRatio, int nMinRetry)
+{
+	m_nRatio = dRatio > 0 ? std::max<int64_t>(1, static_cast<int64_t>(dRatio * 1000)) : 0;
+	m_nMax = std::max(nMinRetry, 1) * 10000;
+	m_nBalance = std::max(nMinRetry, 0) * 1000;
+}
+
+void CRetryBudget::Deposit()
+{
+	if (m_nRatio == 0 || m_nBalance >= m_nMax)
+		return;
+	m_nBalance += m_nRatio;
+}
+
+bool CRetryBudget::Withdraw()
+{
+	if (m_nRatio == 0)
+		return true;
+	if (m_nBalance.fetch_sub(1000) >= 1000)
+		return true;
+	m_nBalance += 1000;
+	return false;
+}
+
+// CRedisEngine methods
+bool CRedisEngine::Start(int nLoopNum, int nConnectMs, int nReadMs, const RedisHandshake &redisHandshake,
+	const RedisSocketOpt &socketOpt, const std::function<void ()> &funcMoved, const std::vector<int> &vecCpu)
+{
+	if (IsRunning())
+		return true;
+	if (nLoopNum <= 0)
+		nLoopNum = !vecCpu.empty() ? static_cast<int>(vecCpu.size()) : std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+	for (int i = 0; i < nLoopNum; ++i)
+	{
+		CRedisLoop *pLoop = new CRedisLoop(nConnectMs, nReadMs, redisHandshake, socketOpt, funcMoved);
+		m_vecLoop.push_back(pLoop);
+		if (!pLoop->Start(vecCpu.empty() ? -1 : vecCpu[i % vecCpu.size()]))
+		{
+			Stop();
+			return false;
+		}
+	}
+	return true;
+}
+
+void CRedisEngine::Stop()
+{
+	for (auto pLoop : m_vecLoop)
+		delete pLoop;
+	m_vecLoop.clear();
+}
+
+int CRedisEngine::Submit(const std::string &strHost, int nPort, const std::vector<std::string> &vecArg, const TFuncDone &funcDone)
+{
+	if (m_vecLoop.empty())
+		return RC_NOT_SUPPORT;
+
+	// every node belongs to one loop, which holds the only engine connection to it. requests to a node
+	// are answered in the order they were submitted
+	size_t nLoop = (std::hash<std::string>()(strHost) * 31 + static_cast<size_t>(nPort)) % m_vecLoop.size();
+	LoopRqst *pRqst = new LoopRqst;
+	pRqst->strHost = strHost;
+	pRqst->nPort = nPort;
+	pRqst->vecArg = vecArg;
+	pRqst->funcDone = funcDone;
+	m_vecLoop[nLoop]->Submit(pRqst);
+	return RC_SUCCESS;
+}
+
+// CRedisLoop methods
+CRedisLoop::CRedisLoop(int nConnectMs, int nReadMs, const RedisHandshake &redisHandshake, const RedisSocketOpt &socketOpt,
+	const std::function<void ()> &funcMoved)
+	: m_nEpoll(-1), m_nEvent(-1), m_nCpu(-1), m_bExit(false), m_bSleeping(false), m_pHead(&m_stub), m_pTail(&m_stub),
+	  m_nConnectTimeout(nConnectMs), m_nReadTimeout(nReadMs), m_redisHandshake(redisHandshake), m_socketOpt(socketOpt),
+	  m_funcMoved(funcMoved)
+{
+}
+
+CRedisLoop::~CRedisLoop()
+{
+	Stop();
+}
+
+#if defined(linux) || defined(__linux) || defined(__linux__)
+static void LoopAddRead(void *pData)
+{
+	LoopConn *pConn = static_cast<LoopConn *>(pData);
+	pConn->pLoop->UpdateEvent(pConn, pConn->nEvents | EPOLLIN);
+}
+
+static void LoopDelRead(void *pData)
+{
+	LoopConn *pConn = static_cast<LoopConn *>(pData);
+	pConn->pLoop->UpdateEvent(pConn, pConn->nEvents & ~EPOLLIN);
+}
+
+static void LoopAddWrite(void *pData)
+{
+	LoopConn *pConn = static_cast<LoopConn *>(pData);
+	pConn->pLoop->UpdateEvent(pConn, pConn->nEvents | EPOLLOUT);
+}
+
+static void LoopDelWrite(void *pData)
+{
+	LoopConn *pConn = static_cast<LoopConn *>(pData);
+	pConn->pLoop->UpdateEvent(pConn, pConn->nEvents & ~EPOLLOUT);
+}
+
+static void LoopCleanup(void *pData)
+{
+	LoopConn *pConn = static_cast<LoopConn *>(pData);
+	pConn->pLoop->CloseConn(pConn);
+}
+
+static void LoopOnConnect(const redisAsyncContext *pAsync, int nStatus)
+{
+	if (nStatus == REDIS_OK)
+		static_cast<LoopConn *>(pAsync->data)->bConnected = true;
+}
+
+static void LoopOnReply(redisAsyncContext *pAsync, void *pReply, void *pPriv)
+{
+	LoopConn *pConn = static_cast<LoopConn *>(pAsync->data);
+	pConn->pLoop->OnReply(pConn, static_cast<LoopRqst *>(pPriv), static_cast<redisReply *>(pReply));
+}
+
+// a refused handshake closes the connection, the requests queued behind it fail
+static void LoopOnHandshake(redisAsyncContext *pAsync, void *pReply, void *)
+{
+	LoopConn *pConn = static_cast<LoopConn *>(pAsync->data);
+	if (!pConn->queSend.empty())
+		pConn->queSend.pop();
+	redisReply *pRedisReply = static_cast<redisReply *>(pReply);
+	if (pRedisReply && pRedisReply->type == REDIS_REPLY_ERROR)
+		redisAsyncFree(pAsync);
+}
+
+bool CRedisLoop::Start(int nCpu)
+{
+	m_nCpu = nCpu;
+	m_nEpoll = epoll_create1(EPOLL_CLOEXEC);
+	m_nEvent = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (m_nEpoll < 0 || m_nEvent < 0)
+		return false;
+
+	// the eventfd is the only registration without a connection
+	struct epoll_event evWake;
+	memset(&evWake, 0, sizeof(evWake));
+	evWake.events = EPOLLIN;
+	evWake.data.ptr = nullptr;
+	if (epoll_ctl(m_nEpoll, EPOLL_CTL_ADD, m_nEvent, &evWake) != 0)
+		return false;
+
+	m_thread = std::thread(std::bind(&CRedisLoop::Run, this));
+	return true;
+}
+
+void CRedisLoop::Stop()
+{
+	if (m_thread.joinable())
+	{
+		m_bExit = true;
+		uint64_t nWake = 1;
+		ssize_t nLen = write(m_nEvent, &nWake, sizeof(nWake));
+		(void)nLen;
+		m_thread.join();
+	}
+	if (m_nEpoll >= 0)
+		close(m_nEpoll);
+	if (m_nEvent >= 0)
+		close(m_nEvent);
+	m_nEpoll = m_nEvent = -1;
+}
+
+// Vyukov's intrusive MPSC queue: a push is one exchange, the loop pops without atomics read-modify-writes
+void CRedisLoop::Submit(LoopRqst *pRqst)
+{
+	pRqst->pNext.store(nullptr, std::memory_order_relaxed);
+	LoopRqst *pPrev = m_pHead.exchange(pRqst);
+	pPrev->pNext.store(pRqst, std::memory_order_release);
+
+	// only a loop about to sleep or sleeping costs a syscall
+	if (m_bSleeping.exchange(false))
+	{
+		uint64_t nWake = 1;
+		ssize_t nLen = write(m_nEvent, &nWake, sizeof(nWake));
+		(void)nLen;
+	}
+}
+
+LoopRqst *CRedisLoop::Pop()
+{
+	LoopRqst *pTail = m_pTail;
+	LoopRqst *pNext = pTail->pNext.load(std::memory_order_acquire);
+	if (pTail == &m_stub)
+	{
+		if (!pNext)
+			return nullptr;
+		m_pTail = pNext;
+		pTail = pNext;
+		pNext = pNext->pNext.load(std::memory_order_acquire);
+	}
+	if (pNext)
+	{
+		m_pTail = pNext;
+		return pTail;
+	}
+	// a producer swapped the head but has not linked its request yet
+	if (pTail != m_pHead.load())
+		return nullptr;
+
+	m_stub.pNext.store(nullptr, std::memory_order_relaxed);
+	LoopRqst *pPrev = m_pHead.exchange(&m_stub);
+	pPrev->pNext.store(&m_stub, std::memory_order_release);
+	pNext = pTail->pNext.load(std::memory_order_acquire);
+	if (pNext)
+	{
+		m_pTail = pNext;
+		return pTail;
+	}
+	return nullptr;
+}
+
+void CRedisLoop::Run()
+{
+	s_bLoopThread = true;
+	if (m_nCpu >= 0)
+		PinThread(std::vector<int>(1, m_nCpu));
+	struct epoll_event arrEvent[128];
+	int64_t nCheckTime = SteadyMs();
+	while (!m_bExit)
+	{
+		// announce the sleep before looking at the queue, a producer then either sees the flag or we see its request
+		m_bSleeping = true;
+		int nWait = m_pHead.load() != m_pTail ? 0 : 100;
+		int nNum = epoll_wait(m_nEpoll, arrEvent, 128, nWait);
+		m_bSleeping = false;
+
+		for (int i = 0; i < nNum; ++i)
+		{
+			LoopConn *pConn = static_cast<LoopConn *>(arrEvent[i].data.ptr);
+			if (!pConn)
+			{
+				uint64_t nWake = 0;
+				ssize_t nLen = read(m_nEvent, &nWake, sizeof(nWake));
+				(void)nLen;
+				continue;
+			}
+			// a connection closed earlier in this batch is deleted at the end of the round
+			if (!pConn->bClosed && (arrEvent[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+				redisAsyncHandleRead(pConn->pAsync);
+			if (!pConn->bClosed && (arrEvent[i].events & EPOLLOUT))
+				redisAsyncHandleWrite(pConn->pAsync);
+		}
+
+		LoopRqst *pRqst = nullptr;
+		while ((pRqst = Pop()))
+			Dispatch(pRqst);
+
+		int64_t nNow = SteadyMs();
+		if (nNow - nCheckTime >= 10)
+		{
+			CheckTimeout(nNow);
+			nCheckTime = nNow;
+		}
+		for (auto pConn : m_vecDead)
+			delete pConn;
+		m_vecDead.clear();
+	}
+
+	// requests in flight and still queued fail, the cleanup hook empties m_mapConn
+	while (!m_mapConn.empty())
+		redisAsyncFree(m_mapConn.begin()->second->pAsync);
+	LoopRqst *pRqst = nullptr;
+	while ((pRqst = Pop()))
+	{
+		pRqst->funcDone(RC_RQST_ERR, nullptr);
+		delete pRqst;
+	}
+	for (auto pConn : m_vecDead)
+		delete pConn;
+	m_vecDead.clear();
+}
+
+void CRedisLoop::Dispatch(LoopRqst *pRqst)
+{
+	LoopConn *pConn = Connect(pRqst->strHost, pRqst->nPort);
+	if (!pConn || !Send(pConn, pRqst->vecArg, false, pRqst))
+	{
+		pRqst->funcDone(RC_RQST_ERR, nullptr);
+		delete pRqst;
+	}
+}
+
+// the connect and the handshake are queued without waiting, the first request follows them
+// on the same socket
+LoopConn *CRedisLoop::Connect(const std::string &strHost, int nPort)
+{
+	std::string strKey = strHost + ":" + std::to_string(nPort);
+	auto it = m_mapConn.find(strKey);
+	if (it != m_mapConn.end())
+		return it->second;
+
+	bool bUnix = IsUnixHost(strHost);
+	redisAsyncContext *pAsync = bUnix ? redisAsyncConnectUnix(strHost.c_str() + sizeof(s_szUnixPrefix) - 1) :
+		redisAsyncConnect(strHost.c_str(), nPort);
+	if (!pAsync)
+		return nullptr;
+	if (pAsync->err)
+	{
+		redisAsyncFree(pAsync);
+		return nullptr;
+	}
+	ApplySocketOpt(&pAsync->c, m_socketOpt, bUnix);
+
+	LoopConn *pConn = new LoopConn;
+	pConn->pLoop = this;
+	pConn->pAsync = pAsync;
+	pConn->strKey = strKey;
+	pAsync->data = pConn;
+	pAsync->ev.data = pConn;
+	pAsync->ev.addRead = LoopAddRead;
+	pAsync->ev.delRead = LoopDelRead;
+	pAsync->ev.addWrite = LoopAddWrite;
+	pAsync->ev.delWrite = LoopDelWrite;
+	pAsync->ev.cleanup = LoopCleanup;
+	redisAsyncSetConnectCallback(pAsync, LoopOnConnect);
+	m_mapConn[strKey] = pConn;
+
+	std::vector<std::vector<std::string> > vecCmd;
+	BuildHandshake(m_redisHandshake, false, vecCmd);
+	for (auto &vecArg : vecCmd)
+	{
+		if (!Send(pConn, vecArg, true, nullptr))
+		{
+			redisAsyncFree(pAsync);
+			return nullptr;
+		}
+	}
+	return pConn;
+}
+
+bool CRedisLoop::Send(LoopConn *pConn, const std::vector<std::string> &vecArg, bool bHandshake, void *pPriv)
+{
+	std::vector<const char *> vecPtr;
+	std::vector<size_t> vecLen;
+	for (auto &strArg : vecArg)
+	{
+		vecPtr.push_back(strArg.c_str());
+		vecLen.push_back(strArg.size());
+	}
+	if (redisAsyncCommandArgv(pConn->pAsync, bHandshake ? LoopOnHandshake : LoopOnReply, pPriv,
+		static_cast<int>(vecArg.size()), vecPtr.data(), vecLen.data()) != REDIS_OK)
+		return false;
+	pConn->queSend.push(SteadyMs());
+	return true;
+}
+
+void CRedisLoop::OnReply(LoopConn *pConn, LoopRqst *pRqst, redisReply *pReply)
+{
+	if (!pConn->queSend.empty())
+		pConn->queSend.pop();
+
+	int nRet = RC_SUCCESS;
+	if (!pReply)
+		nRet = pConn->bTimedOut ? RC_TIMEOUT : RC_RQST_ERR;
+	else if (pReply->type == REDIS_REPLY_ERROR)
+	{
+		nRet = RC_REPLY_ERR;
+		if (m_funcMoved && pReply->str && (!strncmp(pReply->str, "MOVED", 5) || !strncmp(pReply->str, "ASK", 3)))
+			m_funcMoved();
+	}
+	pRqst->funcDone(nRet, pReply);
+	delete pRqst;
+}
+
+void CRedisLoop::UpdateEvent(LoopConn *pConn, uint32_t nEvents)
+{
+	if (nEvents == pConn->nEvents)
+		return;
+
+	struct epoll_event evConn;
+	memset(&evConn, 0, sizeof(evConn));
+	evConn.events = nEvents;
+	evConn.data.ptr = pConn;
+	int nOp = !pConn->nEvents ? EPOLL_CTL_ADD : (!nEvents ? EPOLL_CTL_DEL : EPOLL_CTL_MOD);
+	epoll_ctl(m_nEpoll, nOp, pConn->pAsync->c.fd, &evConn);
+	pConn->nEvents = nEvents;
+}
+
+// called by hiredis when it frees the context, also for a connect which never completed
+void CRedisLoop::CloseConn(LoopConn *pConn)
+{
+	UpdateEvent(pConn, 0);
+	pConn->bClosed = true;
+	auto it = m_mapConn.find(pConn->strKey);
+	if (it != m_mapConn.end() && it->second == pConn)
+		m_mapConn.erase(it);
+	m_vecDead.push_back(pConn);
+}
+
+// replies come in order, so the oldest command of a connection tells whether the node stalls.
+// freeing the context fails everything in flight on it with RC_TIMEOUT
+void CRedisLoop::CheckTimeout(int64_t nNowMs)
+{
+	std::vector<LoopConn *> vecExpired;
+	for (auto &connPair : m_mapConn)
+	{
+		LoopConn *pConn = connPair.second;
+		int nLimit = pConn->bConnected ? m_nReadTimeout : m_nConnectTimeout + m_nReadTimeout;
+		if (nLimit > 0 && !pConn->queSend.empty() && nNowMs - pConn->queSend.front() >= nLimit)
+			vecExpired.push_back(pConn);
+	}
+	for (auto pConn : vecExpired)
+	{
+		pConn->bTimedOut = true;
+		redisAsyncFree(pConn->pAsync);
+	}
+}
+#else
+bool CRedisLoop::Start(int) { return false; }
+void CRedisLoop::Stop() {}
+void CRedisLoop::Submit(LoopRqst *pRqst)
+{
+	pRqst->funcDone(RC_NOT_SUPPORT, nullptr);
+	delete pRqst;
+}
+#endif
+
+// CTaskPool methods
+void CTaskPool::Start(int nThreads, const std::vector<int> &vecCpu)
+{
+	std::lock_guard<std::mutex> guard(m_mutexTask);
+	m_bExit = false;
+	m_vecCpu = vecCpu;
+	for (int i = 0; i < nThreads; ++i)
+		m_vecThread.push_back(std::thread(std::bind(&CTaskPool::Run, this)));
+}
+
+void CTaskPool::Stop()
+{
+	{
+		std::lock_guard<std::mutex> guard(m_mutexTask);
+		m_bExit = true;
+	}
+	m_condTask.notify_all();
+	for (auto &thrd : m_vecThread)
+	{
+		if (thrd.joinable())
+			thrd.join();
+	}
+	m_vecThread.clear();
+}
+
+bool CTaskPool::Submit(std::function<void()> funcTask)
+{
+	{
+		std::lock_guard<std::mutex> guard(m_mutexTask);
+		if (m_bExit || m_vecThread.empty())
+			return false;
+		m_queTask.push(std::move(funcTask));
+	}
+	m_condTask.notify_one();
+	return true;
+}
+
+void CTaskPool::Run()
+{
+	PinThread(m_vecCpu);
+	while (true)
+	{
+		std::function<void()> funcTask;
+		{
+			std::unique_lock<std::mutex> guard(m_mutexTask);
+			m_condTask.wait(guard, [this]() { return m_bExit || !m_queTask.empty(); });
+			if (m_queTask.empty())
+				return;
+			funcTask = std::move(m_queTask.front());
+			m_queTask.pop();
+		}
+		funcTask();
+	}
+}
+
+// CLatencyWindow methods
+void CLatencyWindow::Record(int64_t nMicros)
+{
+	std::lock_guard<std::mutex> guard(m_mutexSample);
+	m_vecSample[m_nNext] = nMicros;
+	m_nNext = (m_nNext + 1) % m_vecSample.size();
+	if (m_nCount < m_vecSample.size())
+		++m_nCount;
+	// the percentile is recomputed every HEDGE_MIN_SAMPLES records, not per request
+	if (m_nNext % HEDGE_MIN_SAMPLES == 0)
+		m_nCached = -1;
+}
+
+int64_t CLatencyWindow::Percentile(double dRatio)
+{
+	std::lock_guard<std::mutex> guard(m_mutexSample);
+	if (m_nCount < HEDGE_MIN_SAMPLES)
+		return -1;
+	if (m_nCached < 0)
+	{
+		std::vector<int64_t> vecSorted(m_vecSample.begin(), m_vecSample.begin() + m_nCount);
+		size_t nIdx = std::min(vecSorted.size() - 1, static_cast<size_t>(dRatio * vecSorted.size()));
+		std::nth_element(vecSorted.begin(), vecSorted.begin() + nIdx, vecSorted.end());
+		m_nCached = vecSorted[nIdx];
+	}
+	return m_nCached;
+}
+
+
+// CRedisClient methods
+CRedisClient::CRedisClient()
+	: m_nPort(-1), m_nClientTimeout(-1), m_nServerTimeout(-1), m_nConnNum(-1), m_nMinIdle(-1),
+      m_pInFlight(std::make_shared<CInFlight>()), m_bCluster(false),
+      m_bShard(false), m_bValid(true), m_bExit(false), m_vecSlaveServ(new std::vector<CRedisServer*>), m_pThread(nullptr),
+      m_bReplicaRead(false), m_bHedgeRead(false), m_dHedgePercentile(0.99), m_nHedgeMinDelay(2), m_nHedgeWorkers(8),
+      m_bRefreshRequested(false), m_bRefreshing(false), m_nRefreshGen(0), m_nRefreshInterval(0),
+      m_nRefreshJitter(0), m_nRefreshSeeds(3), m_nRefreshRound(0), m_bShardsCmd(true), m_nInitMs(0), m_nSlotLoadMs(0),
+      m_bSentinel(false), m_pSentinelThread(nullptr), m_nPingIdle(-1), m_nEvictIdle(0), m_pSweepThread(nullptr),
+      m_pReconnThread(nullptr)
+{
+}
+
+CRedisClient::~CRedisClient()
+{
+	m_engine.Stop();
+	m_bValid = false;
+	m_bExit = true;
+	{
+		std::lock_guard<std::mutex> guard(m_mutexRefresh);
+		m_condRefresh.notify_all();
+	}
+	if (m_pThread)
+	{
+		m_pThread->join();
+		delete m_pThread;
+		m_pThread = nullptr;
+	}
+	if (m_pSentinelThread)
+	{
+		m_pSentinelThread->join();
+		delete m_pSentinelThread;
+		m_pSentinelThread = nullptr;
+	}
+	if (m_pSweepThread)
+	{
+		m_pSweepThread->join();
+		delete m_pSweepThread;
+		m_pSweepThread = nullptr;
+	}
+	if (m_pReconnThread)
+	{
+		m_pReconnThread->join();
+		delete m_pReconnThread;
+		m_pReconnThread = nullptr;
+	}
+	m_poolHedge.Stop();
+	m_poolMget.Stop();
+
+	m_oldServerInfoList.clear();
+	delete m_vecSlaveServ;
+	m_vecSlaveServ = nullptr;
+
+	CleanServer();
+}
+
+bool CRedisClient::Initialize(const std::string &strHost, int nPort, int nClientTimeout, int nServerTimeout, int nConnNum)
+{
+	//client_log_trace("CRedisClient::Initialize [host:", strHost, "][port:", nPort, "]");
+	std::string::size_type nPos = IsUnixHost(strHost) ? std::string::npos : strHost.find(':');
+	m_strHost = (nPos == std::string::npos) ? strHost : strHost.substr(0, nPos);
+	m_nPort = (nPos == std::string::npos) ? nPort : atoi(strHost.substr(nPos + 1).c_str());
+	if (IsUnixHost(m_strHost))
+		m_nPort = 0;
+	m_nClientTimeout = nClientTimeout;
+	m_nServerTimeout = nServerTimeout;
+	m_nConnNum = nConnNum;
+	if (m_strHost.empty() || (m_nPort <= 0 && !IsUnixHost(m_strHost)) || m_nClientTimeout <= 0 || m_nServerTimeout <= 0 || m_nConnNum <= 0)
+		return false;
+
+	auto tmStart = std::chrono::steady_clock::now();
+	if (m_bHedgeRead && !m_poolHedge.IsRunning())
+		m_poolHedge.Start(m_nHedgeWorkers, m_vecCpu);
+
+	// warm start: the snapshot replaces INFO and CLUSTER SLOTS against the seed node
+	if (!m_strSnapshot.empty() && !m_bSentinel)
+	{
+		m_vecRedisServ.store(new std::vector<CRedisServer*>);
+		m_bCluster = true;
+		if (LoadSlotSnapshot())
+		{
+			// the snapshot may be stale, the refresh thread checks it against the cluster right away
+			m_bValid = StartWorker();
+			RequestRefresh();
+			m_nInitMs = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - tmStart).count();
+			return m_bValid;
+		}
+		delete m_vecRedisServ.load();
+		m_bCluster = false;
+	}
+
+	// the mode is unknown until INFO, so the seed skips SELECT which a cluster node refuses
+	RedisHandshake seedHandshake = m_redisHandshake;
+	seedHandshake.nDb = 0;
+    CRedisServer *pRedisServ = new CRedisServer(m_strHost, m_nPort, m_nClientTimeout, m_nServerTimeout, m_nConnNum, false, m_nMinIdle, m_redisTimeout, seedHandshake, m_socketOpt, m_redisLimit, m_pInFlight);
+	std::map<std::string, std::string> mapInfo;
+	auto it = mapInfo.end();
+	if (!pRedisServ->IsValid() || !FetchInfo(pRedisServ, mapInfo) || (it = mapInfo.find("cluster_enabled")) == mapInfo.end())
+	{
+		delete pRedisServ;
+		return false;
+	}
+	m_bCluster = (bool)atoi(it->second.c_str());
+
+	// a standalone seed is opened again with SELECT
+	if (!m_bCluster && m_redisHandshake.nDb > 0)
+	{
+		delete pRedisServ;
+		pRedisServ = new CRedisServer(m_strHost, m_nPort, m_nClientTimeout, m_nServerTimeout, m_nConnNum, false, m_nMinIdle, m_redisTimeout, m_redisHandshake, m_socketOpt, m_redisLimit, m_pInFlight);
+		if (!pRedisServ->IsValid())
+		{
+			delete pRedisServ;
+			return false;
+		}
+	}
+
+	// the sentinels may still announce a master which has just been demoted
+	if (m_bSentinel && (m_bCluster || (it = mapInfo.find("role")) == mapInfo.end() || it->second.compare(0, 6, "master") != 0))
+	{
+		delete pRedisServ;
+		return false;
+	}
+
+	auto server_vec = new std::vector<CRedisServer*>;
+	server_vec->push_back(pRedisServ);	
+	m_vecRedisServ.store(server_vec);
+
+	m_bValid = (m_bCluster ? LoadClusterSlots() : LoadSlaveInfo(mapInfo)) && 
+		StartWorker();
+	m_nInitMs = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - tmStart).count();
+	return m_bValid;
+}
+
+bool CRedisClient::InitializeSentinel(const std::vector<std::string> &vecSentinel, const std::string &strMasterName,
+	int nClientTimeout, int nServerTimeout, int nConnNum)
+{
+	m_vecSentinel.clear();
+	for (auto &strSentinel : vecSentinel)
+	{
+		std::string::size_type nPos = strSentinel.rfind(':');
+		if (nPos == std::string::npos)
+			return false;
+		m_vecSentinel.push_back(std::make_pair(strSentinel.substr(0, nPos), atoi(strSentinel.substr(nPos + 1).c_str())));
+	}
+	m_strMasterName = strMasterName;
+	m_nClientTimeout = nClientTimeout;
+	if (m_vecSentinel.empty() || m_strMasterName.empty())
+		return false;
+
+	std::string strHost;
+	int nPort = -1;
+	m_bSentinel = true;
+	if (!QuerySentinelMaster(strHost, nPort) || !Initialize(strHost, nPort, nClientTimeout, nServerTimeout, nConnNum))
+		return false;
+
+	m_pSentinelThread = new std::thread(std::bind(&CRedisClient::WatchSentinel, this));
+	return true;
+}
+
+bool CRedisClient::InitializeShard(const std::vector<std::string> &vecHost, int nClientTimeout, int nServerTimeout, int nConnNum)
+{
+	std::vector<std::pair<std::string, int> > vecShard;
+	for (auto &strShard : vecHost)
+	{
+		std::string::size_type nPos = strShard.rfind(':');
+		if (nPos == std::string::npos && !IsUnixHost(strShard))
+			return false;
+		auto shardPair = IsUnixHost(strShard) ? std::make_pair(strShard, 0) :
+			std::make_pair(strShard.substr(0, nPos), atoi(strShard.substr(nPos + 1).c_str()));
+		if (shardPair.first.empty() || (shardPair.second <= 0 && !IsUnixHost(shardPair.first)) || std::find(vecShard.begin(), vecShard.end(), shardPair) != vecShard.end())
+			return false;
+		vecShard.push_back(shardPair);
+	}
+	m_nClientTimeout = nClientTimeout;
+	m_nServerTimeout = nServerTimeout;
+	m_nConnNum = nConnNum;
+	if (vecShard.empty() || m_nClientTimeout <= 0 || m_nServerTimeout <= 0 || m_nConnNum <= 0)
+		return false;
+
+	auto tmStart = std::chrono::steady_clock::now();
+	std::vector<SlotRegion> vecSlot;
+	BuildShardSlots(vecShard, vecSlot);
+
+	m_strHost = vecShard.front().first;
+	m_nPort = vecShard.front().second;
+	m_bCluster = true;
+	m_bShard = true;
+	m_vecRedisServ.store(new std::vector<CRedisServer*>);
+	m_bValid = ApplySlotMap(vecSlot, SlotSignature(vecSlot)) &&
+		StartWorker();
+	m_nInitMs = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - tmStart).count();
+	return m_bValid;
+}
+
+void CRedisClient::operator()()
+{
+	PinThread(m_vecCpu);
+	std::mt19937 rndJitter(std::random_device{}());
+	int nBackoff = RECONN_BACKOFF_MIN;
+	while (!m_bExit)
+	{
+		bool bRequested = false;
+		{
+			std::unique_lock<std::mutex> guard(m_mutexRefresh);
+			auto funcWake = [this]() { return m_bExit || m_bRefreshRequested; };
+			if (!m_bValid)
+			{
+				// an unreachable cluster is asked again with exponential backoff instead of every second
+				m_condRefresh.wait_for(guard, std::chrono::milliseconds(JitterMs(nBackoff)), [this]() { return m_bExit; });
+				nBackoff = std::min(nBackoff * 2, RECONN_BACKOFF_MAX);
+			}
+			else if ((m_bCluster || m_bSentinel) && m_nRefreshInterval > 0)
+			{
+				int nJitter = m_nRefreshJitter > 0 ? static_cast<int>(rndJitter() % (m_nRefreshJitter + 1)) : 0;
+				m_condRefresh.wait_for(guard, std::chrono::milliseconds(m_nRefreshInterval + nJitter), funcWake);
+			}
+			else
+				m_condRefresh.wait(guard, funcWake);
+
+			if (m_bExit)
+				break;
+			bRequested = m_bRefreshRequested || !m_bValid;
+			if (m_bValid)
+				nBackoff = RECONN_BACKOFF_MIN;
+			m_bRefreshRequested = false;
+			m_bRefreshing = true;
+		}
+
+		//client_log_info("CRedisClient::operator()()");
+		bool bValid = true;
+		if (m_bShard)
+		{
+			bValid = RefreshShard();
+		}
+		else if (true == m_bCluster)
+		{
+			bValid = LoadClusterSlots();
+		}
+		else if (m_bSentinel)
+		{
+			bValid = RefreshSentinel();
+		}
+		else
+		{
+			CSafeLock safeLock(&m_rwLock);
+			safeLock.WriteLock();
+			std::vector<CRedisServer*>* server = m_vecRedisServ.load();
+			// a down node belongs to the reconnector, the refresh would only repeat its connect timeout
+			if (!server->at(0)->IsDown())
+				server->at(0)->Initialize();
+			safeLock.WriteUnlock();
+		}
 
-    if (!pRedisConn)
-        return RC_NO_RESOURCE;
+		{
+			CSafeLock safeLock(&m_rwLock);
+			safeLock.WriteLock();
+			// a failed periodic refresh keeps serving from the current slot map
+			if (bRequested || bValid)
+				m_bValid = bValid;
+			CleanOldServer();
+			safeLock.WriteUnlock();
+		}
 
-    int nRet = pRedisConn->ConnRequest(pRedisCmd);
-    ReturnConnection(pRedisConn);
-    return nRet;
+		{
+			std::lock_guard<std::mutex> guard(m_mutexRefresh);
+			m_bRefreshing = false;
+			++m_nRefreshGen;
+		}
+		m_condRefresh.notify_all();
+	}
 }
 
-int CRedisServer::ServRequest(CRedisConnection* connection, CRedisCommand *pRedisCmd)
+bool CRedisClient::StartWorker()
 {
-	int nRet = connection->ConnRequest(pRedisCmd);
-	return nRet;
+	m_pThread = new std::thread(std::bind(&CRedisClient::operator(), this));
+	if (m_bCluster && !m_poolMget.IsRunning())
+		m_poolMget.Start(MGET_WORKERS, m_vecCpu);
+	if (m_nPingIdle < 0)
+		m_nPingIdle = m_nServerTimeout * 1000 / 2;
+	if (!m_pSweepThread && (m_nPingIdle > 0 || m_nEvictIdle > 0))
+		m_pSweepThread = new std::thread(std::bind(&CRedisClient::SweepConnection, this));
+	if (!m_pReconnThread)
+		m_pReconnThread = new std::thread(std::bind(&CRedisClient::ReconnectServer, this));
+	return m_pThread != nullptr;
 }
 
-
-// CRedisClient methods
-CRedisClient::CRedisClient()
-	: m_nPort(-1), m_nClientTimeout(-1), m_nServerTimeout(-1), m_nConnNum(-1), m_bCluster(false),
-      m_bValid(true), m_bExit(false), m_pThread(nullptr)
+void CRedisClient::SweepConnection()
 {
-#if defined(linux) || defined(__linux) || defined(__linux__)
-    pthread_rwlockattr_init(&m_rwAttr);
-    pthread_rwlockattr_setkind_np(&m_rwAttr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
-    pthread_rwlock_init(&m_rwLock, &m_rwAttr);
-#else
-	//pthread_rwlock_init(&m_rwLock, nullptr);
-	InitializeSRWLock(&m_rwLock);
-#endif
+	PinThread(m_vecCpu);
+	int nPeriod = std::min(m_nPingIdle > 0 ? m_nPingIdle : INT_MAX, m_nEvictIdle > 0 ? m_nEvictIdle : INT_MAX) / 2;
+	nPeriod = std::max(100, std::min(nPeriod, 1000));
+	while (!m_bExit)
+	{
+		{
+			std::unique_lock<std::mutex> guard(m_mutexRefresh);
+			m_condRefresh.wait_for(guard, std::chrono::milliseconds(nPeriod), [this]() { return m_bExit; });
+			if (m_bExit)
+				break;
+		}
+
+		// servers are never deleted while the client lives, only the vectors holding them
+		std::vector<CRedisServer *> vecServ;
+		{
+			CSafeLock safeLock(&m_rwLock);
+			safeLock.ReadLock();
+			auto server = m_vecRedisServ.load();
+			vecServ.assign(server->begin(), server->end());
+			vecServ.insert(vecServ.end(), m_vecSlaveServ->begin(), m_vecSlaveServ->end());
+			safeLock.ReadUnlock();
+		}
+		int64_t nNow = SteadyMs();
+		for (auto pRedisServ : vecServ)
+			pRedisServ->KeepAlive(nNow, m_nPingIdle, m_nEvictIdle);
+	}
 }
 
-CRedisClient::~CRedisClient()
+// reconnects down nodes with exponential backoff off the request path. nodes which the slot map
+// dropped meanwhile are still probed until their vector is cleaned, which is harmless
+void CRedisClient::ReconnectServer()
 {
-	m_bValid = false;
-	m_bExit = true;
-	{
-		CSafeLock safeLock(&m_rwLock);
-		safeLock.WriteLock();
-		m_condAny.notify_all();
-		safeLock.WriteUnlock();
-	}
-	if (m_pThread)
+	PinThread(m_vecCpu);
+	int64_t nWakeMs = 250;
+	while (!m_bExit)
 	{
-		m_pThread->join();
-		delete m_pThread;
-		m_pThread = nullptr;
+		{
+			std::unique_lock<std::mutex> guard(m_mutexRefresh);
+			m_condRefresh.wait_for(guard, std::chrono::milliseconds(nWakeMs), [this]() { return m_bExit; });
+			if (m_bExit)
+				break;
+		}
+
+		std::vector<CRedisServer *> vecServ;
+		{
+			CSafeLock safeLock(&m_rwLock);
+			safeLock.ReadLock();
+			auto server = m_vecRedisServ.load();
+			vecServ.assign(server->begin(), server->end());
+			vecServ.insert(vecServ.end(), m_vecSlaveServ->begin(), m_vecSlaveServ->end());
+			safeLock.ReadUnlock();
+		}
+
+		// a node marked down between two rounds waits at most the idle period for its first attempt
+		nWakeMs = 250;
+		for (auto pRedisServ : vecServ)
+		{
+			if (!pRedisServ->IsDown())
+				continue;
+			int64_t nNext = pRedisServ->Probe(SteadyMs());
+			if (nNext > 0)
+				nWakeMs = std::min<int64_t>(nWakeMs, std::max<int64_t>(10, nNext - SteadyMs()));
+		}
 	}
+}
 
-	m_oldServerInfoList.clear();
+void CRedisClient::SetLimit(const RedisLimit &redisLimit)
+{
+	m_redisLimit = redisLimit;
+	m_pInFlight->Reset(redisLimit.nClientNum, redisLimit.nClientBytes);
+}
 
-	CleanServer();
-#if defined(linux) || defined(__linux) || defined(__linux__)
-	pthread_rwlockattr_destroy(&m_rwAttr);
-#endif
-	//pthread_rwlock_destroy(&m_rwLock);
+void CRedisClient::SetHedgedRead(bool bEnable, double dPercentile, int nMinDelayMs, int nWorkers, double dBudget)
+{
+	m_hedgeBudget.Reset(dBudget, 10);
+	m_bHedgeRead = bEnable;
+	m_dHedgePercentile = (dPercentile > 0 && dPercentile < 1) ? dPercentile : 0.99;
+	m_nHedgeMinDelay = nMinDelayMs > 0 ? nMinDelayMs : 1;
+	m_nHedgeWorkers = nWorkers > 0 ? nWorkers : 1;
 }
 
-bool CRedisClient::Initialize(const std::string &strHost, int nPort, int nClientTimeout, int nServerTimeout, int nConnNum)
+void CRedisClient::SetTopologyRefresh(int nIntervalMs, int nJitterMs, int nSeedNum)
 {
-	//client_log_trace("CRedisClient::Initialize [host:", strHost, "][port:", nPort, "]");
-	std::string::size_type nPos = strHost.find(':');
-	m_strHost = (nPos == std::string::npos) ? strHost : strHost.substr(0, nPos);
-	m_nPort = (nPos == std::string::npos) ? nPort : atoi(strHost.substr(nPos + 1).c_str());
-	m_nClientTimeout = nClientTimeout;
-	m_nServerTimeout = nServerTimeout;
-	m_nConnNum = nConnNum;
-	if (m_strHost.empty() || m_nPort <= 0 || m_nClientTimeout <= 0 || m_nServerTimeout <= 0 || m_nConnNum <= 0)
-		return false;
+	m_nRefreshInterval = nIntervalMs > 0 ? nIntervalMs : 0;
+	m_nRefreshJitter = nJitterMs > 0 ? nJitterMs : 0;
+	m_nRefreshSeeds = nSeedNum > 0 ? nSeedNum : 1;
+}
 
-    CRedisServer *pRedisServ = new CRedisServer(m_strHost, m_nPort, m_nClientTimeout, m_nServerTimeout, m_nConnNum);
-    if (!pRedisServ->IsValid())
-        return false;
+void CRedisClient::GetStat(RedisStat *pStat)
+{
+	if (!pStat)
+		return;
 
-	std::string strInfo;
-	std::map<std::string, std::string> mapInfo;
-	CRedisCommand redisCmd("info");
-	//redisCmd.SetArgs();
-	if (pRedisServ->ServRequest(&redisCmd) != RC_SUCCESS ||
-		redisCmd.FetchResult(BIND_STR(&strInfo)) != RC_SUCCESS ||
-		!ConvertToMapInfo(strInfo, mapInfo))
-		return false;
+	pStat->nInitMs = m_nInitMs;
+	pStat->nSlotLoadMs = m_nSlotLoadMs;
+	pStat->nServNum = 0;
+	pStat->nConnNum = 0;
+	pStat->nIdleConn = 0;
+	pStat->nMaxConn = 0;
+	pStat->nPeakConn = 0;
+	pStat->nGrowNum = 0;
+	pStat->nShrinkNum = 0;
+	pStat->nWaitNum = 0;
+	pStat->nExhaustNum = 0;
+	pStat->nDownNum = 0;
+	pStat->nUringConn = 0;
+	pStat->nZeroCopySend = 0;
+	pStat->nZeroCopyCopied = 0;
+	pStat->nBulkConn = 0;
+	pStat->nInFlight = 0;
+	pStat->nLimitNum = 0;
+	pStat->nRejectNum = 0;
+	m_pInFlight->AddStat(pStat, true);
 
-	auto it = mapInfo.find("cluster_enabled");
-	if (it == mapInfo.end())
-		return false;
-	else
-		m_bCluster = (bool)atoi(it->second.c_str());
+	CSafeLock safeLock(&m_rwLock);
+	safeLock.ReadLock();
+	auto server = m_vecRedisServ.load();
+	if (server)
+	{
+		pStat->nServNum = static_cast<int>(server->size());
+		for (auto pRedisServ : *server)
+			pRedisServ->AddStat(pStat);
+	}
+	safeLock.ReadUnlock();
+}
 
-	auto server_vec = new std::vector<CRedisServer*>;
-	server_vec->push_back(pRedisServ);	
-	m_vecRedisServ.store(server_vec);
+bool CRedisClient::StartEngine(int nLoopNum)
+{
+	if (!m_bValid)
+		return false;
+	int nConnect = m_redisTimeout.nConnectMs >= 0 ? m_redisTimeout.nConnectMs : m_nClientTimeout * 1000;
+	int nRead = m_redisTimeout.nReadMs > 0 ? m_redisTimeout.nReadMs : m_nClientTimeout * 1000;
+	return m_engine.Start(nLoopNum, nConnect, nRead, NodeHandshake(), m_socketOpt, [this]() { RequestRefresh(); }, m_vecCpu);
+}
 
-	m_bValid = (m_bCluster ? LoadClusterSlots() : LoadSlaveInfo(mapInfo)) && 
-		(m_pThread = new std::thread(std::bind(&CRedisClient::operator(), this))) != nullptr;
-	return m_bValid;
+std::vector<int> CRedisClient::NicCpus(const std::string &strIfName)
+{
+	std::vector<int> vecCpu;
+	int nNode = -1;
+	std::ifstream ifsNode("/sys/class/net/" + strIfName + "/device/numa_node");
+	if (!(ifsNode >> nNode) || nNode < 0)
+		return vecCpu;
+
+	// cpulist reads like "0-7,16-23"
+	std::ifstream ifsCpu("/sys/devices/system/node/node" + std::to_string(nNode) + "/cpulist");
+	std::string strRange;
+	while (std::getline(ifsCpu, strRange, ','))
+	{
+		int nFirst = -1;
+		int nLast = -1;
+		int nNum = sscanf(strRange.c_str(), "%d-%d", &nFirst, &nLast);
+		if (nNum < 1 || nFirst < 0)
+			continue;
+		for (int nCpu = nFirst; nCpu <= (nNum == 2 ? nLast : nFirst); ++nCpu)
+			vecCpu.push_back(nCpu);
+	}
+	return vecCpu;
 }
 
-void CRedisClient::operator()()
+int CRedisClient::AsyncCommand(const CRedisKey &redisKey, const std::vector<std::string> &vecArg, const TFuncDone &funcDone)
 {
-	while (!m_bExit)
+	if (vecArg.empty() || !funcDone)
+		return RC_PARAM_ERR;
+	if (!m_engine.IsRunning())
+		return RC_NOT_SUPPORT;
+
+	CSafeLock safeLock(&m_rwLock);
+	if (!safeLock.ReadLock() || !m_bValid)
 	{
-		{
-			CSafeLock safeLock(&m_rwLock);
-			safeLock.WriteLock();
+		safeLock.ReadUnlock();
+		return RC_RQST_ERR;
+	}
+	auto server = m_vecRedisServ.load();
+	CRedisServer *pRedisServ = m_bCluster ? FindServer(redisKey.Slot()) : (server->empty() ? nullptr : server->at(0));
+	// the strings are copied before the lock goes, a refresh may replace the server
+	std::string strHost = pRedisServ ? pRedisServ->GetHost() : std::string();
+	int nPort = pRedisServ ? pRedisServ->GetPort() : 0;
+	bool bDown = pRedisServ && pRedisServ->IsDown();
+	std::shared_ptr<CInFlight> pNodeFlight = pRedisServ ? pRedisServ->m_pInFlight : nullptr;
+	safeLock.ReadUnlock();
 
-			if (m_bValid)
-			{
-				m_condAny.wait(safeLock);
-			}
-			
-			//client_log_info("CRedisClient::operator()()");
-			//m_bValid = m_bCluster ? LoadClusterSlots() : m_vecRedisServ[0]->Initialize();
-			if (true == m_bCluster)
-			{
-				m_bValid = LoadClusterSlots();
-			}
-			else
-			{
-				std::vector<CRedisServer*>* server = m_vecRedisServ.load();
-				server->at(0)->Initialize();
-								
-			}
-			CleanOldServer();
+	if (strHost.empty() || bDown)
+		return RC_RQST_ERR;
 
-			safeLock.WriteUnlock();
+	// a full node or client blocks the caller (LIMIT_BLOCK) instead of growing the loop queues. a callback
+	// chaining a command runs on the loop thread, the only one which can release room, so it fails fast
+	RedisLimit redisLimit = m_redisLimit;
+	if (s_bLoopThread)
+		redisLimit.nMode = LIMIT_FAIL;
+	int64_t nBytes = 0;
+	for (auto &strArg : vecArg)
+		nBytes += static_cast<int64_t>(strArg.size());
+	std::shared_ptr<CInFlight> pClientFlight = m_pInFlight;
+	int nRet = AcquireFlight(pClientFlight.get(), pNodeFlight.get(), nBytes, CRedisPriority::Current(), redisLimit, CDeadline());
+	if (nRet != RC_SUCCESS)
+		return nRet;
+	nRet = m_engine.Submit(strHost, nPort, vecArg, [pClientFlight, pNodeFlight, nBytes, funcDone](int nStatus, redisReply *pReply) {
+		ReleaseFlight(pClientFlight.get(), pNodeFlight.get(), nBytes);
+		funcDone(nStatus, pReply);
+	});
+	if (nRet != RC_SUCCESS)
+		ReleaseFlight(pClientFlight.get(), pNodeFlight.get(), nBytes);
+	return nRet;
+}
+
+int CRedisClient::GetTopology(std::vector<RedisNode> *pvecNode)
+{
+	if (!pvecNode)
+		return RC_PARAM_ERR;
+	if (!m_bCluster)
+		return RC_NOT_SUPPORT;
+
+	pvecNode->clear();
+	std::vector<RedisNode> vecSlave;
+	auto funcKnown = [](const std::vector<RedisNode> &vecNode, const RedisNode &redisNode)
+	{
+		for (auto &elm : vecNode)
+		{
+			if (redisNode.strId.empty() ? (elm.strHost == redisNode.strHost && elm.nPort == redisNode.nPort) : elm.strId == redisNode.strId)
+				return true;
 		}
+		return false;
+	};
 
-		if (!m_bValid)
-			std::this_thread::sleep_for(std::chrono::seconds(1));
+	CSafeLock safeLock(&m_rwLock);
+	safeLock.ReadLock();
+	for (auto &slotReg : m_vecSlot)
+	{
+		for (auto &redisNode : slotReg.vecNode)
+		{
+			std::vector<RedisNode> &vecNode = redisNode.bMaster ? *pvecNode : vecSlave;
+			if (!funcKnown(vecNode, redisNode))
+				vecNode.push_back(redisNode);
+		}
 	}
+	safeLock.ReadUnlock();
+
+	pvecNode->insert(pvecNode->end(), vecSlave.begin(), vecSlave.end());
+	return RC_SUCCESS;
+}
+
+RedisHandshake CRedisClient::NodeHandshake() const
+{
+	RedisHandshake redisHandshake = m_redisHandshake;
+	// sharded standalone instances also run in m_bCluster and keep their database
+	if (m_bCluster && !m_bShard)
+		redisHandshake.nDb = 0;
+	return redisHandshake;
 }
 
 void CRedisClient::CleanOldServer()
@@ -1047,10 +3452,10 @@ void CRedisClient::CleanOldServer()
 //    //return ExecuteImpl("del", strKey, HASH_SLOT(strKey), ppLine, BIND_INT(pnVal));
 //}
 
-int CRedisClient::Del(CRedisConnection* connection, const std::string &strKey, OUT RedisResult* result)
+int CRedisClient::Del(CRedisConnection* connection, const CRedisKey &redisKey, OUT RedisResult* result, const CDeadline &deadline)
 {
-	std::string command = "del " + strKey;
-	return ExecuteImplPool(connection, command, HASH_SLOT(strKey), BIND_MULTI(result));
+	std::string command = "del " + redisKey.Str();
+	return ExecuteImplPool(connection, command, redisKey.Slot(), deadline, BIND_MULTI(result));
 	//return ExecuteImpl("del", strKey, HASH_SLOT(strKey), ppLine, BIND_INT(pnVal));
 }
 
@@ -1075,10 +3480,10 @@ int CRedisClient::Del(CRedisConnection* connection, const std::string &strKey, O
 //    //return ExecuteImpl("expire", strKey, ConvertToString(nSec), HASH_SLOT(strKey), ppLine, BIND_INT(pnVal));
 //}
 
-int CRedisClient::Expire(CRedisConnection* connection, const std::string &strKey, long nSec, long *pnVal)
+int CRedisClient::Expire(CRedisConnection* connection, const CRedisKey &redisKey, long nSec, long *pnVal, const CDeadline &deadline)
 {
-	std::string command = "expire " + strKey + " " + std::to_string(nSec);
-	return ExecuteImplPool(connection, command, HASH_SLOT(strKey), BIND_STR(nullptr), StuResConv());
+	std::string command = "expire " + redisKey.Str() + " " + std::to_string(nSec);
+	return ExecuteImplPool(connection, command, redisKey.Slot(), deadline, BIND_STR(nullptr), StuResConv());
 	//return ExecuteImpl("expire", strKey, ConvertToString(nSec), HASH_SLOT(strKey), ppLine, BIND_INT(pnVal));
 }
 //
@@ -1088,36 +3493,20 @@ int CRedisClient::Expire(CRedisConnection* connection, const std::string &strKey
 //	return ExecuteImpl(command, HASH_SLOT(strKey), BIND_INT(pnVal));
 //    //return ExecuteImpl("expireat", strKey, ConvertToString(nTime), HASH_SLOT(strKey), ppLine, BIND_INT(pnVal));
 //}
-//
-//int CRedisClient::Keys(const std::string &strPattern, std::vector<std::string> *pvecVal)
-//{
-//    CRedisCommand redisCmd("keys");
-//    redisCmd.SetArgs(strPattern);
-//
-//    int nRet = RC_SUCCESS;
-//    std::vector<std::string> vecVal;
-//	
-//    //for (auto pRedisServ : m_vecRedisServ)
-//	auto server = m_vecRedisServ.load();
-//	for (auto itr = server->begin(); itr != server->end(); ++itr)
-//    {
-//		CRedisServer* pRedisServ = *itr;
-//        if ((nRet = pRedisServ->ServRequest(&redisCmd)) != RC_SUCCESS ||
-//            (nRet = redisCmd.FetchResult(BIND_VSTR(&vecVal))) != RC_SUCCESS)
-//        {
-//            if (pvecVal)
-//                pvecVal->clear();
-//            return nRet;
-//        }
-//        else
-//        {
-//            if (pvecVal)
-//                std::copy(vecVal.begin(), vecVal.end(), std::back_inserter(*pvecVal));
-//        }
-//    }
-//    return nRet;
-//}
-//
+
+int CRedisClient::Keys(const std::string &strPattern, std::vector<std::string> *pvecVal, const CDeadline &deadline)
+{
+	std::vector<NodeReply> vecReply;
+	int nRet = FanOut("keys " + strPattern, &vecReply, false, deadline);
+	if (pvecVal)
+	{
+		pvecVal->clear();
+		if (nRet == RC_SUCCESS)
+			ConcatReply(vecReply, pvecVal);
+	}
+	return nRet == RC_PART_SUCCESS ? RC_REPLY_ERR : nRet;
+}
+
 //int CRedisClient::Persist(const std::string &strKey, long *pnVal)
 //{
 //	std::string command = "persist " + strKey;
@@ -1306,18 +3695,22 @@ int CRedisClient::Expire(CRedisConnection* connection, const std::string &strKey
 //    //return ExecuteImpl("decrby", strKey, ConvertToString(nDecr), HASH_SLOT(strKey), ppLine, BIND_INT(pnVal));
 //}
 //
-//int CRedisClient::Get(const std::string &strKey, std::string *pstrVal)
-//{
-//	std::string command = "get " + strKey;
-//	return ExecuteImpl(command, HASH_SLOT(strKey), BIND_STR(pstrVal));
-//    //return ExecuteImpl("get", strKey, HASH_SLOT(strKey), ppLine, BIND_STR(pstrVal));
-//}
+int CRedisClient::Get(const CRedisKey &redisKey, std::string *pstrVal, const CDeadline &deadline)
+{
+	std::string command = "get " + redisKey.Str();
+	if (m_bHedgeRead)
+		return ExecuteHedged(command, redisKey.Slot(), deadline, BIND_STR(pstrVal));
+	if (m_bReplicaRead)
+		return ExecuteReplica(command, redisKey.Slot(), deadline, BIND_STR(pstrVal));
+	return ExecuteImpl(command, redisKey.Slot(), deadline, BIND_STR(pstrVal));
+    //return ExecuteImpl("get", strKey, HASH_SLOT(strKey), ppLine, BIND_STR(pstrVal));
+}
 
-int CRedisClient::Get(CRedisConnection* connection, const std::string &strKey, std::string *pstrVal)
+int CRedisClient::Get(CRedisConnection* connection, const CRedisKey &redisKey, std::string *pstrVal, const CDeadline &deadline)
 {
-	std::string command = "get " + strKey;
+	std::string command = "get " + redisKey.Str();
 	//return ExecuteImpl("set", strKey, strVal, HASH_SLOT(strKey), ppLine, BIND_STR(nullptr), StuResConv());
-	return ExecuteImplPool(connection, command, HASH_SLOT(strKey), BIND_STR(pstrVal));
+	return ExecuteImplPool(connection, command, redisKey.Slot(), deadline, BIND_STR(pstrVal));
 }
 
 //int CRedisClient::Getbit(const std::string &strKey, long nOffset, long *pnVal)
@@ -1366,27 +3759,80 @@ int CRedisClient::Get(CRedisConnection* connection, const std::string &strKey, s
 //	return nRet;
 //}
 //
-//int CRedisClient::Mget(const std::vector<std::string> &vecKey, std::vector<std::string> *pvecVal)
-//{
-//	if (vecKey.empty())
-//		return RC_SUCCESS;
-//
-//	if (!m_bCluster)
-//	{
-//		std::string arg;
-//		for (auto elm : vecKey)
-//		{
-//			arg += " " + elm;
-//		}
-//		std::string command = "mget " + arg;
-//		return ExecuteImpl(command, HASH_SLOT(vecKey[0]), BIND_VSTR(pvecVal));
-//		//return ExecuteImpl("mget", vecKey, HASH_SLOT(vecKey[0]), nullptr, BIND_VSTR(pvecVal));
-//	}
-//    else
-//    {
-//		return RC_NOT_SUPPORT;
-//    }
-//}
+int CRedisClient::Mget(const std::vector<std::string> &vecKey, std::vector<std::string> *pvecVal, const CDeadline &deadline)
+{
+	if (pvecVal)
+		pvecVal->clear();
+	if (vecKey.empty())
+		return RC_SUCCESS;
+
+	if (!m_bCluster)
+	{
+		std::string command = "mget";
+		for (auto &elm : vecKey)
+			command += " " + elm;
+		return ExecuteImpl(command, -1, deadline, BIND_VSTR(pvecVal));
+	}
+	if (!m_bValid)
+		return RC_RQST_ERR;
+
+	// a cluster node refuses keys of different slots in one MGET, a shard takes all of its keys at once
+	std::vector<uint32_t> vecSlot;
+	HASH_SLOT(vecKey, &vecSlot);
+	std::map<CRedisServer *, std::map<int, std::vector<size_t> > > mapGroup;
+	{
+		CSafeLock safeLock(&m_rwLock);
+		safeLock.ReadLock();
+		for (size_t i = 0; i < vecKey.size(); ++i)
+			mapGroup[FindServer(vecSlot[i])][m_bShard ? 0 : vecSlot[i]].push_back(i);
+		safeLock.ReadUnlock();
+	}
+
+	// one task per node, the groups of a node run one after another and go through Execute for MOVED.
+	// the caller takes the first node itself, the others go to a small pool shared by the client
+	std::vector<std::string> vecVal(vecKey.size());
+	auto funcNode = [this, &vecKey, &vecSlot, &vecVal, &deadline](const std::map<int, std::vector<size_t> > *pmapSlot)
+	{
+		int nRet = RC_SUCCESS;
+		for (auto &slotPair : *pmapSlot)
+		{
+			std::string command = "mget";
+			for (auto nIdx : slotPair.second)
+				command += " " + vecKey[nIdx];
+			std::vector<std::string> vecPart;
+			int nPartRet = ExecuteImpl(command, vecSlot[slotPair.second.front()], deadline, BIND_VSTR(&vecPart));
+			if (nPartRet == RC_SUCCESS && vecPart.size() != slotPair.second.size())
+				nPartRet = RC_REPLY_ERR;
+			if (nPartRet != RC_SUCCESS)
+			{
+				nRet = nPartRet;
+				continue;
+			}
+			for (size_t i = 0; i < vecPart.size(); ++i)
+				vecVal[slotPair.second[i]].swap(vecPart[i]);
+		}
+		return nRet;
+	};
+	std::vector<std::future<int> > vecFuture;
+	for (auto it = std::next(mapGroup.begin()); it != mapGroup.end(); ++it)
+	{
+		auto pTask = std::make_shared<std::packaged_task<int()> >(std::bind(funcNode, &it->second));
+		vecFuture.push_back(pTask->get_future());
+		if (!m_poolMget.Submit([pTask]() { (*pTask)(); }))
+			(*pTask)();
+	}
+
+	int nRet = funcNode(&mapGroup.begin()->second);
+	for (auto &futRet : vecFuture)
+	{
+		int nPartRet = futRet.get();
+		if (nPartRet != RC_SUCCESS && nRet == RC_SUCCESS)
+			nRet = nPartRet;
+	}
+	if (nRet == RC_SUCCESS && pvecVal)
+		pvecVal->swap(vecVal);
+	return nRet;
+}
 //
 //int CRedisClient::Mset(const std::vector<std::string> &vecKey, const std::vector<std::string> &vecVal)
 //{
@@ -1438,15 +3884,15 @@ int CRedisClient::Get(CRedisConnection* connection, const std::string &strKey, s
 //	return ExecuteImpl(command, HASH_SLOT(strKey), BIND_STR(nullptr), StuResConv());
 //}
 
-int CRedisClient::Set(CRedisConnection* connection, const std::string &strKey, const std::string &strVal, unsigned int expired)
+int CRedisClient::Set(CRedisConnection* connection, const CRedisKey &redisKey, const std::string &strVal, unsigned int expired, const CDeadline &deadline)
 {
-	std::string command = "set " + strKey + " " + strVal;
+	std::string command = "set " + redisKey.Str() + " " + strVal;
 	if (0 < expired)
 	{
-		command = "set " + strKey + " " + strVal + " PX " + std::to_string(expired);
+		command = "set " + redisKey.Str() + " " + strVal + " PX " + std::to_string(expired);
 	}
 	//return ExecuteImpl("set", strKey, strVal, HASH_SLOT(strKey), ppLine, BIND_STR(nullptr), StuResConv());
-	return ExecuteImplPool(connection, command, HASH_SLOT(strKey), BIND_STR(nullptr), StuResConv());
+	return ExecuteImplPool(connection, command, redisKey.Slot(), deadline, BIND_STR(nullptr), StuResConv());
 }
 
 //int CRedisClient::Setbit(const std::string &strKey, long nOffset, bool bVal)
@@ -1463,10 +3909,10 @@ int CRedisClient::Set(CRedisConnection* connection, const std::string &strKey, c
 //    //return ExecuteImpl("setex", strKey, ConvertToString(nSec), strVal, HASH_SLOT(strKey), ppLine, BIND_STR(nullptr), StuResConv());
 //}
 
-int CRedisClient::Setex(CRedisConnection* connection, const std::string &strKey, long nSec, const std::string &strVal)
+int CRedisClient::Setex(CRedisConnection* connection, const CRedisKey &redisKey, long nSec, const std::string &strVal, const CDeadline &deadline)
 {
-	std::string command = "setex " + strKey + " " + std::to_string(nSec) + " " + strVal;
-	return ExecuteImplPool(connection, command, HASH_SLOT(strKey), BIND_STR(nullptr), StuResConv());
+	std::string command = "setex " + redisKey.Str() + " " + std::to_string(nSec) + " " + strVal;
+	return ExecuteImplPool(connection, command, redisKey.Slot(), deadline, BIND_STR(nullptr), StuResConv());
 	//return ExecuteImpl("setex", strKey, ConvertToString(nSec), strVal, HASH_SLOT(strKey), ppLine, BIND_STR(nullptr), StuResConv());
 }
 
@@ -1477,10 +3923,10 @@ int CRedisClient::Setex(CRedisConnection* connection, const std::string &strKey,
 //    //return ExecuteImpl("setnx", strKey, strVal, HASH_SLOT(strKey), ppLine, BIND_INT(nullptr), IntResConv(RC_OBJ_EXIST));
 //}
 
-int CRedisClient::Setnx(CRedisConnection* connection, const std::string &strKey, const std::string &strVal)
+int CRedisClient::Setnx(CRedisConnection* connection, const CRedisKey &redisKey, const std::string &strVal, const CDeadline &deadline)
 {
-	std::string command = "setnx " + strKey + " " + strVal;
-	return ExecuteImplPool(connection, command, HASH_SLOT(strKey), BIND_STR(nullptr), StuResConv());
+	std::string command = "setnx " + redisKey.Str() + " " + strVal;
+	return ExecuteImplPool(connection, command, redisKey.Slot(), deadline, BIND_STR(nullptr), StuResConv());
 	//return ExecuteImpl("setnx", strKey, strVal, HASH_SLOT(strKey), ppLine, BIND_INT(nullptr), IntResConv(RC_OBJ_EXIST));
 }
 
@@ -2086,12 +4532,189 @@ int CRedisClient::Setnx(CRedisConnection* connection, const std::string &strKey,
 //    return ExecuteImpl("time", -1, BIND_TIME(ptmVal));
 //}
 
-int CRedisClient::ExecuteImpl(const std::string &strCmd, int nSlot, TFuncFetch funcFetch, TFuncConvert funcConv)
+int CRedisClient::Dbsize(long *pnVal, const CDeadline &deadline)
+{
+	std::vector<NodeReply> vecReply;
+	int nRet = FanOut("dbsize", &vecReply, false, deadline);
+	if (nRet == RC_SUCCESS && pnVal)
+		*pnVal = SumReply(vecReply);
+	return nRet == RC_PART_SUCCESS ? RC_REPLY_ERR : nRet;
+}
+
+int CRedisClient::FanOut(const std::string &strCmd, std::vector<NodeReply> *pvecReply, bool bAllNodes, const CDeadline &deadline)
+{
+	if (!m_bValid)
+		return RC_RQST_ERR;
+
+	// replicas with a pool (hedged or replica reads) use it, the others get a one connection pool which
+	// later fan-outs reuse
+	std::vector<CRedisServer *> vecServ;
+	std::vector<std::pair<std::string, int> > vecTempHost;
+	{
+		CSafeLock safeLock(&m_rwLock);
+		safeLock.ReadLock();
+		auto server = m_vecRedisServ.load();
+		vecServ.assign(server->begin(), server->end());
+		if (bAllNodes)
+		{
+			if (m_bCluster)
+			{
+				for (auto &slotReg : m_vecSlot)
+				{
+					for (auto &slavePair : slotReg.vecSlave)
+					{
+						if (slotReg.pSlaveServ && slotReg.pSlaveServ->GetHost() == slavePair.first && slotReg.pSlaveServ->GetPort() == slavePair.second)
+						{
+							if (std::find(vecServ.begin(), vecServ.end(), slotReg.pSlaveServ) == vecServ.end())
+								vecServ.push_back(slotReg.pSlaveServ);
+						}
+						else if (std::find(vecTempHost.begin(), vecTempHost.end(), slavePair) == vecTempHost.end())
+							vecTempHost.push_back(slavePair);
+					}
+				}
+			}
+			else if (!server->empty())
+			{
+				std::vector<std::pair<std::string, int> > vecHosts = server->at(0)->GetHosts();
+				for (size_t i = 1; i < vecHosts.size(); ++i)
+				{
+					CRedisServer *pSlaveServ = FindServer(m_vecSlaveServ, vecHosts[i].first, vecHosts[i].second);
+					if (pSlaveServ)
+						vecServ.push_back(pSlaveServ);
+					else
+						vecTempHost.push_back(vecHosts[i]);
+				}
+			}
+		}
+		safeLock.ReadUnlock();
+	}
+
+	// replicas which left the topology are dropped from the cache, a down one is connected again
+	std::vector<std::shared_ptr<CRedisServer> > vecTempServ;
+	std::vector<std::pair<std::string, int> > vecNewHost;
+	if (bAllNodes)
+	{
+		std::lock_guard<std::mutex> guard(m_mutexFanOut);
+		for (auto it = m_mapFanOutServ.begin(); it != m_mapFanOutServ.end(); )
+		{
+			if (std::find(vecTempHost.begin(), vecTempHost.end(), it->first) == vecTempHost.end() || it->second->IsDown())
+				it = m_mapFanOutServ.erase(it);
+			else
+				++it;
+		}
+		for (auto &hostPair : vecTempHost)
+		{
+			auto it = m_mapFanOutServ.find(hostPair);
+			if (it != m_mapFanOutServ.end())
+				vecTempServ.push_back(it->second);
+			else
+				vecNewHost.push_back(hostPair);
+		}
+	}
+
+	std::vector<std::future<NodeReply> > vecFuture;
+	auto funcRequest = [strCmd, deadline](CRedisServer *pRedisServ)
+	{
+		NodeReply nodeReply;
+		nodeReply.strHost = pRedisServ->GetHost();
+		nodeReply.nPort = pRedisServ->GetPort();
+		nodeReply.nVal = 0;
+		CRedisCommand redisCmd(strCmd);
+		redisCmd.SetDeadline(deadline);
+		nodeReply.nRet = pRedisServ->ServRequest(&redisCmd);
+		if (nodeReply.nRet == RC_SUCCESS)
+			nodeReply.nRet = redisCmd.FetchResult(std::bind(&FetchNodeReply, std::placeholders::_1, &nodeReply));
+		return nodeReply;
+	};
+	for (auto pRedisServ : vecServ)
+		vecFuture.push_back(std::async(std::launch::async, funcRequest, pRedisServ));
+	for (auto &pTempServ : vecTempServ)
+		vecFuture.push_back(std::async(std::launch::async, [funcRequest, pTempServ]() { return funcRequest(pTempServ.get()); }));
+	for (auto &hostPair : vecNewHost)
+	{
+		vecFuture.push_back(std::async(std::launch::async, [this, funcRequest, hostPair]()
+		{
+			auto pTempServ = std::make_shared<CRedisServer>(hostPair.first, hostPair.second, m_nClientTimeout, m_nServerTimeout, 1, m_bCluster,
+				-1, m_redisTimeout, NodeHandshake(), m_socketOpt, m_redisLimit, m_pInFlight);
+			NodeReply nodeReply = funcRequest(pTempServ.get());
+			if (pTempServ->IsValid())
+			{
+				std::lock_guard<std::mutex> guard(m_mutexFanOut);
+				m_mapFanOutServ[hostPair] = pTempServ;
+			}
+			return nodeReply;
+		}));
+	}
+
+	int nSucc = 0;
+	if (pvecReply)
+		pvecReply->clear();
+	for (auto &futReply : vecFuture)
+	{
+		NodeReply nodeReply = futReply.get();
+		if (nodeReply.nRet == RC_SUCCESS)
+			++nSucc;
+		if (pvecReply)
+			pvecReply->push_back(std::move(nodeReply));
+	}
+
+	if (nSucc == static_cast<int>(vecFuture.size()))
+		return vecFuture.empty() ? RC_RQST_ERR : RC_SUCCESS;
+	return nSucc > 0 ? RC_PART_SUCCESS : RC_RQST_ERR;
+}
+
+long CRedisClient::SumReply(const std::vector<NodeReply> &vecReply)
+{
+	long nSum = 0;
+	for (auto &nodeReply : vecReply)
+	{
+		if (nodeReply.nRet == RC_SUCCESS)
+			nSum += nodeReply.nVal;
+	}
+	return nSum;
+}
+
+void CRedisClient::ConcatReply(const std::vector<NodeReply> &vecReply, std::vector<std::string> *pvecVal)
+{
+	if (!pvecVal)
+		return;
+
+	for (auto &nodeReply : vecReply)
+	{
+		if (nodeReply.nRet == RC_SUCCESS)
+			std::copy(nodeReply.vecVal.begin(), nodeReply.vecVal.end(), std::back_inserter(*pvecVal));
+	}
+}
+
+void CRedisClient::MergeReply(const std::vector<NodeReply> &vecReply, std::map<std::string, std::string> *pmapVal)
+{
+	if (!pmapVal)
+		return;
+
+	for (auto &nodeReply : vecReply)
+	{
+		if (nodeReply.nRet != RC_SUCCESS)
+			continue;
+
+		std::map<std::string, std::string> mapNode;
+		if (!nodeReply.vecVal.empty())
+		{
+			for (size_t i = 0; i + 1 < nodeReply.vecVal.size(); i += 2)
+				mapNode.insert(std::make_pair(nodeReply.vecVal[i], nodeReply.vecVal[i + 1]));
+		}
+		else
+			ConvertToMapInfo(nodeReply.strVal, mapNode);
+		pmapVal->insert(mapNode.begin(), mapNode.end());
+	}
+}
+
+int CRedisClient::ExecuteImpl(const std::string &strCmd, int nSlot, const CDeadline &deadline, TFuncFetch funcFetch, TFuncConvert funcConv)
 {
     CRedisCommand *pRedisCmd = new CRedisCommand(strCmd);
 //    pRedisCmd->SetArgs();
     pRedisCmd->SetSlot(nSlot);
     pRedisCmd->SetConvFunc(funcConv);
+    pRedisCmd->SetDeadline(deadline);
     int nRet = Execute(pRedisCmd);
 	if (nRet == RC_SUCCESS)
 	{
@@ -2102,12 +4725,13 @@ int CRedisClient::ExecuteImpl(const std::string &strCmd, int nSlot, TFuncFetch f
     return nRet;
 }
 
-int CRedisClient::ExecuteImplPool(CRedisConnection* connection, const std::string &strCmd, int nSlot, TFuncFetch funcFetch, TFuncConvert funcConv)
+int CRedisClient::ExecuteImplPool(CRedisConnection* connection, const std::string &strCmd, int nSlot, const CDeadline &deadline, TFuncFetch funcFetch, TFuncConvert funcConv)
 {
 	CRedisCommand *pRedisCmd = new CRedisCommand(strCmd);
 	//    pRedisCmd->SetArgs();
 	pRedisCmd->SetSlot(nSlot);
 	pRedisCmd->SetConvFunc(funcConv);
+	pRedisCmd->SetDeadline(deadline);
 	int nRet = ExecutePool(connection, pRedisCmd);
 	if (nRet != RC_SUCCESS)
 	{
@@ -2122,28 +4746,340 @@ int CRedisClient::ExecuteImplPool(CRedisConnection* connection, const std::strin
 	return nRet;
 }
 
+int CRedisClient::ExecuteHedged(const std::string &strCmd, int nSlot, const CDeadline &deadline, TFuncFetch funcFetch, TFuncConvert funcConv)
+{
+	struct HedgeState
+	{
+		std::mutex mutexState;
+		std::condition_variable condState;
+		bool bDone = false;
+		int nPending = 0;
+		int nRet = RC_RQST_ERR;
+	};
+
+	CRedisServer *pMaster = nullptr;
+	CRedisServer *pSlave = nullptr;
+	{
+		CRedisCommand redisCmd(strCmd);
+		redisCmd.SetSlot(nSlot);
+		CSafeLock safeLock(&m_rwLock);
+		if (!safeLock.ReadLock() || !m_bValid)
+		{
+			safeLock.ReadUnlock();
+			return RC_RQST_ERR;
+		}
+		pMaster = GetMatchedServer(&redisCmd);
+		pSlave = GetMatchedSlave(&redisCmd);
+		safeLock.ReadUnlock();
+	}
+	if (!pMaster || !pSlave || !pSlave->IsValid() || pSlave->IsDown())
+		return ExecuteImpl(strCmd, nSlot, deadline, funcFetch, funcConv);
+
+	// the loser can not be cancelled on a blocking connection, its reply is discarded
+	// and the connection goes back to its pool once the request completes
+	auto pState = std::make_shared<HedgeState>();
+	// the hedge is sent with the priority of the caller
+	int nPriority = CRedisPriority::Current();
+	auto funcSend = [strCmd, nSlot, deadline, funcConv, nPriority](CRedisServer *pRedisServ, CRedisCommand &redisCmd)
+	{
+		redisCmd.SetSlot(nSlot);
+		redisCmd.SetPriority(nPriority);
+		redisCmd.SetConvFunc(funcConv);
+		redisCmd.SetDeadline(deadline);
+		int nRet = pRedisServ->ServRequest(&redisCmd);
+		bool bAnswered = nRet == RC_SUCCESS && redisCmd.GetReply() && redisCmd.GetReply()->type != REDIS_REPLY_ERROR;
+		return bAnswered ? RC_SUCCESS : (nRet == RC_SUCCESS ? RC_REPLY_ERR : nRet);
+	};
+
+	// the hedge fires at a fixed time, a worker picking it up late does not push it back. it is
+	// dropped once the master has answered and when the budget is spent
+	m_hedgeBudget.Deposit();
+	int64_t nDelay = std::max<int64_t>(m_latPrimary.Percentile(m_dHedgePercentile), m_nHedgeMinDelay * 1000);
+	auto tmHedge = std::chrono::steady_clock::now() + std::chrono::microseconds(nDelay);
+	auto funcHedge = [this, pState, pSlave, tmHedge, strCmd, funcFetch, funcSend]()
+	{
+		{
+			std::unique_lock<std::mutex> guard(pState->mutexState);
+			if (pState->condState.wait_until(guard, tmHedge, [&]() { return pState->bDone; }) || !m_hedgeBudget.Withdraw())
+			{
+				--pState->nPending;
+				pState->condState.notify_all();
+				return;
+			}
+		}
+		CRedisCommand redisCmd(strCmd);
+		int nRet = funcSend(pSlave, redisCmd);
+		std::lock_guard<std::mutex> guard(pState->mutexState);
+		--pState->nPending;
+		if (!pState->bDone && nRet == RC_SUCCESS)
+		{
+			pState->nRet = redisCmd.FetchResult(funcFetch);
+			pState->bDone = true;
+		}
+		pState->condState.notify_all();
+	};
+	pState->nPending = m_poolHedge.Submit(funcHedge) ? 1 : 0;
+
+	// the master is read on the calling thread, so the pool never holds back the primary request
+	auto tmStart = std::chrono::steady_clock::now();
+	CRedisCommand redisCmd(strCmd);
+	int nRet = funcSend(pMaster, redisCmd);
+	if (nRet == RC_SUCCESS)
+		m_latPrimary.Record(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - tmStart).count());
+
+	std::unique_lock<std::mutex> guard(pState->mutexState);
+	if (!pState->bDone && nRet == RC_SUCCESS)
+	{
+		pState->nRet = redisCmd.FetchResult(funcFetch);
+		pState->bDone = true;
+		pState->condState.notify_all();
+	}
+	// a failed master waits for a hedge in flight, it carries the same deadline
+	if (!pState->bDone && pState->nPending > 0)
+	{
+		auto funcSettled = [&]() { return pState->bDone || pState->nPending == 0; };
+		if (deadline.IsSet())
+			pState->condState.wait_for(guard, std::chrono::milliseconds(deadline.RemainMs()), funcSettled);
+		else
+			pState->condState.wait(guard, funcSettled);
+	}
+	// funcFetch writes into the caller's frame, a hedge finishing after we gave up must drop its reply
+	if (!pState->bDone)
+	{
+		pState->bDone = true;
+		pState->condState.notify_all();
+		if (deadline.Expired())
+			return RC_TIMEOUT;
+	}
+	else
+		nRet = pState->nRet;
+	guard.unlock();
+
+	// the normal path takes care of MOVED and refreshing the topology
+	if ((nRet == RC_RQST_ERR || nRet == RC_REPLY_ERR) && !deadline.Expired())
+		return ExecuteImpl(strCmd, nSlot, deadline, funcFetch, funcConv);
+	return nRet;
+}
+
+int CRedisClient::ExecuteReplica(const std::string &strCmd, int nSlot, const CDeadline &deadline, TFuncFetch funcFetch, TFuncConvert funcConv)
+{
+	CRedisCommand redisCmd(strCmd);
+	redisCmd.SetSlot(nSlot);
+	redisCmd.SetConvFunc(funcConv);
+	redisCmd.SetDeadline(deadline);
+
+	CRedisServer *pSlave = nullptr;
+	{
+		CSafeLock safeLock(&m_rwLock);
+		if (!safeLock.ReadLock() || !m_bValid)
+		{
+			safeLock.ReadUnlock();
+			return RC_RQST_ERR;
+		}
+		pSlave = GetMatchedSlave(&redisCmd);
+		safeLock.ReadUnlock();
+	}
+
+	int nRet = (pSlave && pSlave->IsValid() && !pSlave->IsDown()) ? pSlave->ServRequest(&redisCmd) : RC_RQST_ERR;
+	if (nRet == RC_SUCCESS && redisCmd.GetReply() && redisCmd.GetReply()->type != REDIS_REPLY_ERROR)
+		return redisCmd.FetchResult(funcFetch);
+	return nRet == RC_TIMEOUT ? nRet : ExecuteImpl(strCmd, nSlot, deadline, funcFetch, funcConv);
+}
+
 // private methods
+bool CRedisClient::FetchInfo(CRedisServer *pRedisServ, std::map<std::string, std::string> &mapInfo)
+{
+	std::string strInfo;
+	CRedisCommand redisCmd("info");
+	//redisCmd.SetArgs();
+	// control-plane commands skip the in-flight limits, a full node must not take the topology down
+	return pRedisServ->PoolRequest(&redisCmd) == RC_SUCCESS &&
+		redisCmd.FetchResult(BIND_STR(&strInfo)) == RC_SUCCESS &&
+		ConvertToMapInfo(strInfo, mapInfo);
+}
+
+bool CRedisClient::QuerySentinelMaster(std::string &strHost, int &nPort)
+{
+	struct timeval tmTimeout = {static_cast<long>(m_nClientTimeout), 0};
+	for (auto &sentinelPair : m_vecSentinel)
+	{
+		redisContext *pContext = redisConnectWithTimeout(sentinelPair.first.c_str(), sentinelPair.second, tmTimeout);
+		if (!pContext || pContext->err)
+		{
+			if (pContext)
+				redisFree(pContext);
+			continue;
+		}
+
+		redisSetTimeout(pContext, tmTimeout);
+		redisReply *pReply = static_cast<redisReply *>(redisCommand(pContext, "SENTINEL get-master-addr-by-name %s", m_strMasterName.c_str()));
+		bool bFound = pReply && pReply->type == REDIS_REPLY_ARRAY && pReply->elements == 2 &&
+			pReply->element[0]->type == REDIS_REPLY_STRING && pReply->element[1]->type == REDIS_REPLY_STRING;
+		if (bFound)
+		{
+			strHost.assign(pReply->element[0]->str, pReply->element[0]->len);
+			nPort = atoi(pReply->element[1]->str);
+		}
+		if (pReply)
+			freeReplyObject(pReply);
+		redisFree(pContext);
+		if (bFound)
+			return true;
+	}
+	return false;
+}
+
+bool CRedisClient::RefreshSentinel()
+{
+	std::pair<std::string, int> hostPair;
+	{
+		std::lock_guard<std::mutex> guard(m_mutexRefresh);
+		hostPair.swap(m_switchHost);
+	}
+	if (hostPair.first.empty() && !QuerySentinelMaster(hostPair.first, hostPair.second))
+		return false;
+
+	CRedisServer *pRedisServ = m_vecRedisServ.load()->at(0);
+	if (pRedisServ->GetHost() != hostPair.first || pRedisServ->GetPort() != hostPair.second)
+		return SwitchMaster(hostPair.first, hostPair.second);
+	// the same master with a working pool, nothing to rebuild
+	if (pRedisServ->IsValid())
+		return true;
+
+	CSafeLock safeLock(&m_rwLock);
+	safeLock.WriteLock();
+	bool bValid = pRedisServ->Initialize();
+	safeLock.WriteUnlock();
+	return bValid;
+}
+
+// the ring never changes, a shard which went down is reconnected in place and only its keys fail meanwhile.
+// a down shard belongs to the reconnector, the refresh only reopens pools which lost their connections
+bool CRedisClient::RefreshShard()
+{
+	std::vector<std::future<bool> > vecFuture;
+	bool bReachable = false;
+	auto server = m_vecRedisServ.load();
+	for (auto pRedisServ : *server)
+	{
+		if (pRedisServ->IsDown())
+			continue;
+		if (pRedisServ->IsValid())
+			bReachable = true;
+		else
+			vecFuture.push_back(std::async(std::launch::async, [pRedisServ]() { return pRedisServ->Initialize(); }));
+	}
+	for (auto &futInit : vecFuture)
+		bReachable = futInit.get() || bReachable;
+	return bReachable;
+}
+
+bool CRedisClient::SwitchMaster(const std::string &strHost, int nPort)
+{
+	std::map<std::string, std::string> mapInfo;
+	CRedisServer *pRedisServ = new CRedisServer(strHost, nPort, m_nClientTimeout, m_nServerTimeout, m_nConnNum, false, m_nMinIdle, m_redisTimeout, NodeHandshake(), m_socketOpt, m_redisLimit, m_pInFlight);
+	if (!pRedisServ->IsValid() || !FetchInfo(pRedisServ, mapInfo) ||
+		mapInfo.find("role") == mapInfo.end() || mapInfo["role"].compare(0, 6, "master") != 0)
+	{
+		delete pRedisServ;
+		return false;
+	}
+
+	std::vector<CRedisServer*> *pvecOld = nullptr;
+	{
+		CSafeLock safeLock(&m_rwLock);
+		safeLock.WriteLock();
+		pvecOld = m_vecRedisServ.load();
+		m_oldServerInfoList.emplace_back(pvecOld);
+		m_vecRedisServ.store(new std::vector<CRedisServer*>(1, pRedisServ));
+		safeLock.WriteUnlock();
+	}
+	// the demoted master keeps no connections, requests still holding one close it on return
+	for (auto pOldServ : *pvecOld)
+		pOldServ->Retire();
+	return LoadSlaveInfo(mapInfo);
+}
+
+void CRedisClient::WatchSentinel()
+{
+	PinThread(m_vecCpu);
+	struct timeval tmTimeout = {static_cast<long>(m_nClientTimeout), 0};
+	size_t nIdx = 0;
+	while (!m_bExit)
+	{
+		const std::pair<std::string, int> &sentinelPair = m_vecSentinel[nIdx++ % m_vecSentinel.size()];
+		redisContext *pContext = redisConnectWithTimeout(sentinelPair.first.c_str(), sentinelPair.second, tmTimeout);
+		redisReply *pReply = nullptr;
+		if (pContext && !pContext->err)
+			pReply = static_cast<redisReply *>(redisCommand(pContext, "SUBSCRIBE +switch-master"));
+		if (!pReply)
+		{
+			if (pContext)
+				redisFree(pContext);
+			std::unique_lock<std::mutex> guard(m_mutexRefresh);
+			m_condRefresh.wait_for(guard, std::chrono::seconds(1), [this]() { return m_bExit; });
+			continue;
+		}
+		freeReplyObject(pReply);
+
+		// the socket is polled so the thread notices m_bExit without a read timeout breaking the context
+		while (!m_bExit)
+		{
+			pReply = nullptr;
+			if (redisReaderGetReply(pContext->reader, (void **)&pReply) != REDIS_OK)
+				break;
+			if (pReply)
+			{
+				// message, +switch-master, "<name> <old ip> <old port> <new ip> <new port>"
+				if (pReply->type == REDIS_REPLY_ARRAY && pReply->elements == 3 && pReply->element[2]->type == REDIS_REPLY_STRING)
+				{
+					std::stringstream ss(std::string(pReply->element[2]->str, pReply->element[2]->len));
+					std::string strName, strOldHost, strNewHost;
+					int nOldPort = -1, nNewPort = -1;
+					if ((ss >> strName >> strOldHost >> nOldPort >> strNewHost >> nNewPort) && strName == m_strMasterName)
+					{
+						std::lock_guard<std::mutex> guard(m_mutexRefresh);
+						m_switchHost = std::make_pair(strNewHost, nNewPort);
+						m_bRefreshRequested = true;
+						m_condRefresh.notify_all();
+					}
+				}
+				freeReplyObject(pReply);
+				continue;
+			}
+
+			fd_set fdRead;
+			FD_ZERO(&fdRead);
+			FD_SET(pContext->fd, &fdRead);
+			struct timeval tmPoll = {1, 0};
+			int nReady = select(static_cast<int>(pContext->fd) + 1, &fdRead, nullptr, nullptr, &tmPoll);
+			if (nReady < 0 || (nReady > 0 && redisBufferRead(pContext) != REDIS_OK))
+				break;
+		}
+		redisFree(pContext);
+	}
+}
+
 bool CRedisClient::LoadSlaveInfo(const std::map<std::string, std::string> &mapInfo)
 {
     auto it = mapInfo.find("connected_slaves");
     if (it == mapInfo.end())
         return true;
 
-    std::stringstream ss;
+    auto new_vec_slave = std::make_unique< std::vector<CRedisServer *> >();
     std::string strItem;
     int nSlave = atoi(it->second.c_str());
     for (int i = 0; i < nSlave; ++i)
     {
-        ss.str();
-        ss << "slave" << i;
-        it = mapInfo.find(ss.str());
+        it = mapInfo.find("slave" + std::to_string(i));
         if (it == mapInfo.end())
             continue;
 
+        // slave0:ip=127.0.0.1,port=6380,state=online,offset=..,lag=..
         std::string strHost;
         int nPort = -1;
-        ss.str(it->second);
-        while (ss >> strItem)
+        std::stringstream ss(it->second);
+        while (std::getline(ss, strItem, ','))
         {
             if (strItem.substr(0, 3) == "ip=")
                 strHost = strItem.substr(3);
@@ -2155,95 +5091,319 @@ bool CRedisClient::LoadSlaveInfo(const std::map<std::string, std::string> &mapIn
 		if (!strHost.empty() && nPort != -1)
 		{
 			//m_vecRedisServ[0]->SetSlave(strHost, nPort);
+			// with sentinels a lost master is replaced through the sentinels, never by one of its replicas
 			std::vector<CRedisServer*>* server = m_vecRedisServ.load();
-			server->at(0)->SetSlave(strHost, nPort);
+			if (!m_bSentinel)
+				server->at(0)->SetSlave(strHost, nPort);
+			if (NeedSlavePool() && new_vec_slave->empty())
+			{
+				CRedisServer *pSlaveServ = new CRedisServer(strHost, nPort, m_nClientTimeout, m_nServerTimeout, m_nConnNum, false, m_nMinIdle, m_redisTimeout, NodeHandshake(), m_socketOpt, m_redisLimit, m_pInFlight);
+				if (pSlaveServ->IsValid())
+					new_vec_slave->push_back(pSlaveServ);
+				else
+					delete pSlaveServ;
+			}
 		}
 
     }
+
+    CSafeLock safeLock(&m_rwLock);
+    safeLock.WriteLock();
+    m_oldServerInfoList.emplace_back(m_vecSlaveServ);
+    m_vecSlaveServ = new_vec_slave.release();
+    safeLock.WriteUnlock();
     return true;
 }
 
 bool CRedisClient::LoadClusterSlots()
 {
 	auto vec_server = m_vecRedisServ.load();
+	auto tmStart = std::chrono::steady_clock::now();
 
 	//client_log_trace("CRedisClient::LoadClusterSlots [size:", static_cast<int>(server->size()), "]");
-	auto new_vec_server = std::make_unique< std::vector<CRedisServer *> >();
-    //std::vector<CRedisServer *>* vecRedisServ = new std::vector<CRedisServer*>;
-    std::vector<SlotRegion> vecSlot;
-    CRedisCommand redisCmd("cluster slots");
-	//redisCmd.SetArgs("slots");
-
-	
-    for (size_t i = 0; i < vec_server->size(); ++i)
-    {
-        CRedisServer *pRedisServ = vec_server->at(i);
-        if (!pRedisServ->IsValid())
-        {
-			//client_log_error("CRedisClient::LoadClusterSlots vecRedisServ not valid server");
-            return false;
-        }
+	// ask several nodes at once, starting from a different one every round
+	std::vector<std::future<std::vector<SlotRegion> > > vecFuture;
+	size_t nRound = m_nRefreshRound++;
+	for (size_t i = 0; i < vec_server->size() && static_cast<int>(vecFuture.size()) < m_nRefreshSeeds; ++i)
+	{
+		CRedisServer *pRedisServ = vec_server->at((nRound + i) % vec_server->size());
+		if (!pRedisServ->IsValid())
+			continue;
 
-        CRedisServer *pSlotServ = nullptr;
-		if (pRedisServ->ServRequest(&redisCmd) == RC_SUCCESS &&
-			redisCmd.FetchResult(BIND_SLOT(&vecSlot)) == RC_SUCCESS)
+		vecFuture.push_back(std::async(std::launch::async, [this, pRedisServ]()
 		{
-			//client_log_info("LoadClusterSlots cluster slot [size:", vecSlot.size(), "]");
-			if (vecSlot.size() == 0)
+			std::vector<SlotRegion> vecSlot;
+			int nRet = RC_REPLY_ERR;
+			if (m_bShardsCmd)
+			{
+				// the slot map is loaded past the in-flight limits, see FetchInfo
+				CRedisCommand redisCmd("cluster shards");
+				if ((nRet = pRedisServ->PoolRequest(&redisCmd)) == RC_SUCCESS)
+					nRet = redisCmd.FetchResult(BIND_SHARD(&vecSlot));
+				// only an unknown command means an older server, the node list is not retried on every refresh.
+				// LOADING, CLUSTERDOWN or a reply which does not parse fall back for this round only
+				std::string strErr = redisCmd.FetchErrMsg();
+				std::transform(strErr.begin(), strErr.end(), strErr.begin(), ::tolower);
+				if (nRet == RC_REPLY_ERR && (strErr.find("unknown command") != std::string::npos ||
+					strErr.find("unknown subcommand") != std::string::npos))
+					m_bShardsCmd = false;
+			}
+			if (nRet == RC_REPLY_ERR)
 			{
-				//client_log_error("LoadClusterSlots size is 0");
-				return false;
+				CRedisCommand redisCmd("cluster slots");
+				if ((nRet = pRedisServ->PoolRequest(&redisCmd)) == RC_SUCCESS)
+					nRet = redisCmd.FetchResult(BIND_SLOT(&vecSlot));
 			}
+			if (nRet != RC_SUCCESS)
+				vecSlot.clear();
+
+			// an unknown endpoint stands for the node which answered
 			for (auto &slotReg : vecSlot)
 			{
-				if (!(pSlotServ = FindServer(new_vec_server.get(), slotReg.strHost, slotReg.nPort)))
+				for (auto &redisNode : slotReg.vecNode)
 				{
-					pSlotServ = new CRedisServer(slotReg.strHost, slotReg.nPort, m_nClientTimeout, m_nServerTimeout, m_nConnNum);
-					if (!pSlotServ->IsValid())
-					{
-						//client_log_error("CRedisClient::LoadClusterSlots FindSerrver not valid server");
-						return false;
-					}
-					new_vec_server->push_back(pSlotServ);
+					if (redisNode.strHost.empty())
+						redisNode.strHost = pRedisServ->GetHost();
+				}
+				for (auto &slavePair : slotReg.vecSlave)
+				{
+					if (slavePair.first.empty())
+						slavePair.first = pRedisServ->GetHost();
 				}
-				slotReg.pRedisServ = pSlotServ;
+				if (slotReg.strHost.empty())
+					slotReg.strHost = pRedisServ->GetHost();
 			}
+			std::sort(vecSlot.begin(), vecSlot.end());
+			return vecSlot;
+		}));
+	}
 
-			{
-				//std::mutex mutex;
-				//mutex.lock();
-				CleanServer();
-				std::sort(vecSlot.begin(), vecSlot.end());
-
-				//m_vecRedisServ = vecRedisServ;
-				m_oldServerInfoList.push_back( ServerInfoQ(vec_server) );
-				m_vecSlot = vecSlot;
-				m_vecRedisServ.store(new_vec_server.release());
-				//mutex.unlock();
-			}
-			return true;
-        }
-    }
-	//client_log_error("CRedisClient::LoadClusterSlots cout is 0");
-    return false;
+	// the view reported by most nodes wins, ties go to the node asked first
+	std::vector<std::vector<SlotRegion> > vecView;
+	std::vector<std::string> vecSign;
+	std::map<std::string, int> mapVote;
+	for (auto &futSlot : vecFuture)
+	{
+		std::vector<SlotRegion> vecSlot = futSlot.get();
+		if (vecSlot.empty())
+			continue;
+		vecSign.push_back(SlotSignature(vecSlot));
+		vecView.push_back(std::move(vecSlot));
+		++mapVote[vecSign.back()];
+	}
+	if (vecView.empty())
+	{
+		//client_log_error("CRedisClient::LoadClusterSlots no node answered");
+		return false;
+	}
+
+	size_t nBest = 0;
+	for (size_t i = 1; i < vecView.size(); ++i)
+	{
+		if (mapVote[vecSign[i]] > mapVote[vecSign[nBest]])
+			nBest = i;
+	}
+	if (vecSign[nBest] == m_strSlotSign)
+		return true;
+
+	if (!ApplySlotMap(vecView[nBest], vecSign[nBest]))
+		return false;
+
+	m_nSlotLoadMs = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - tmStart).count();
+	if (!m_strSnapshot.empty())
+		SaveSlotSnapshot(vecView[nBest]);
+	return true;
 }
 
-bool CRedisClient::WaitForRefresh()
+bool CRedisClient::ApplySlotMap(std::vector<SlotRegion> &vecSlot, const std::string &strSign)
 {
+	auto vec_server = m_vecRedisServ.load();
+
+	// nodes already known keep their connection pools, new nodes are connected concurrently
+	std::map<std::pair<std::string, int>, std::future<CRedisServer *> > mapFuture;
+	auto funcCreate = [this, &mapFuture](const std::string &strHost, int nPort, bool bReadOnly)
+	{
+		auto hostPair = std::make_pair(strHost, nPort);
+		if (mapFuture.find(hostPair) == mapFuture.end())
+		{
+			mapFuture[hostPair] = std::async(std::launch::async, [this, strHost, nPort, bReadOnly]()
+			{
+				return new CRedisServer(strHost, nPort, m_nClientTimeout, m_nServerTimeout, m_nConnNum, bReadOnly, m_nMinIdle, m_redisTimeout, NodeHandshake(), m_socketOpt, m_redisLimit, m_pInFlight);
+			});
+		}
+	};
+	for (auto &slotReg : vecSlot)
+	{
+		CRedisServer *pOldServ = FindServer(vec_server, slotReg.strNodeId, slotReg.strHost, slotReg.nPort);
+		if (!pOldServ || !pOldServ->IsValid())
+			funcCreate(slotReg.strHost, slotReg.nPort, false);
+		// replica pools are only needed for hedged and replica reads
+		if (NeedSlavePool() && !slotReg.vecSlave.empty() &&
+			!FindServer(m_vecSlaveServ, slotReg.vecSlave.front().first, slotReg.vecSlave.front().second))
+			funcCreate(slotReg.vecSlave.front().first, slotReg.vecSlave.front().second, true);
+	}
+
+	std::map<std::pair<std::string, int>, CRedisServer *> mapCreated;
+	for (auto &futPair : mapFuture)
+		mapCreated[futPair.first] = futPair.second.get();
+
+	auto new_vec_server = std::make_unique< std::vector<CRedisServer *> >();
+	auto new_vec_slave = std::make_unique< std::vector<CRedisServer *> >();
+	CRedisServer *pSlotServ = nullptr;
+	bool bFailed = false;
+	bool bReachable = false;
+	for (auto &slotReg : vecSlot)
+	{
+		auto itCreated = mapCreated.find(std::make_pair(slotReg.strHost, slotReg.nPort));
+		pSlotServ = itCreated != mapCreated.end() ? itCreated->second : FindServer(vec_server, slotReg.strNodeId, slotReg.strHost, slotReg.nPort);
+		bReachable = bReachable || pSlotServ->IsValid();
+		// an unreachable shard stays in the ring as a down node, the reconnector brings it back
+		if (!pSlotServ->IsValid() && !m_bShard)
+		{
+			//client_log_error("CRedisClient::LoadClusterSlots FindSerrver not valid server");
+			bFailed = true;
+			break;
+		}
+		if (!FindServer(new_vec_server.get(), slotReg.strHost, slotReg.nPort))
+			new_vec_server->push_back(pSlotServ);
+		if (pSlotServ->m_strNodeId.empty())
+			pSlotServ->m_strNodeId = slotReg.strNodeId;
+		slotReg.pRedisServ = pSlotServ;
+
+		// a broken replica only disables hedging for the slots
+		if (NeedSlavePool() && !slotReg.vecSlave.empty())
+		{
+			const std::pair<std::string, int> &slavePair = slotReg.vecSlave.front();
+			itCreated = mapCreated.find(slavePair);
+			pSlotServ = itCreated != mapCreated.end() ? itCreated->second : FindServer(m_vecSlaveServ, slavePair.first, slavePair.second);
+			if (!FindServer(new_vec_slave.get(), slavePair.first, slavePair.second))
+				new_vec_slave->push_back(pSlotServ);
+			slotReg.pSlaveServ = pSlotServ;
+		}
+	}
+	if (bFailed || (m_bShard && !bReachable))
+	{
+		for (auto &createdPair : mapCreated)
+			delete createdPair.second;
+		return false;
+	}
+
 	{
 		CSafeLock safeLock(&m_rwLock);
-		if (safeLock.TryReadLock())
+		safeLock.WriteLock();
+		CleanServer();
+
+		m_oldServerInfoList.emplace_back(vec_server);
+		m_oldServerInfoList.emplace_back(m_vecSlaveServ);
+		m_vecSlot = vecSlot;
+		m_strSlotSign = strSign;
+		m_vecRedisServ.store(new_vec_server.release());
+		m_vecSlaveServ = new_vec_slave.release();
+		safeLock.WriteUnlock();
+	}
+	return true;
+}
+
+// snapshot lines: <start slot> <end slot> <master host> <master port> [<slave host> <slave port>]...
+bool CRedisClient::LoadSlotSnapshot()
+{
+	std::ifstream ifs(m_strSnapshot);
+	if (!ifs)
+		return false;
+
+	std::vector<SlotRegion> vecSlot;
+	std::string strLine;
+	while (std::getline(ifs, strLine))
+	{
+		if (strLine.empty() || strLine[0] == '#')
+			continue;
+
+		std::stringstream ss(strLine);
+		SlotRegion slotReg;
+		slotReg.pRedisServ = nullptr;
+		slotReg.pSlaveServ = nullptr;
+		if (!(ss >> slotReg.nStartSlot >> slotReg.nEndSlot >> slotReg.strHost >> slotReg.nPort) ||
+			slotReg.nStartSlot < 0 || slotReg.nEndSlot > 16383 || slotReg.nStartSlot > slotReg.nEndSlot)
+			return false;
+
+		std::string strHost;
+		int nPort;
+		while (ss >> strHost >> nPort)
+			slotReg.vecSlave.push_back(std::make_pair(strHost, nPort));
+		vecSlot.push_back(slotReg);
+	}
+	if (vecSlot.empty())
+		return false;
+
+	std::sort(vecSlot.begin(), vecSlot.end());
+	auto tmStart = std::chrono::steady_clock::now();
+	if (!ApplySlotMap(vecSlot, SlotSignature(vecSlot)))
+		return false;
+	m_nSlotLoadMs = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - tmStart).count();
+	return true;
+}
+
+void CRedisClient::SaveSlotSnapshot(const std::vector<SlotRegion> &vecSlot) const
+{
+	// written aside and renamed so a crashing process never leaves a truncated map behind
+	std::string strTmp = m_strSnapshot + ".tmp";
+	{
+		std::ofstream ofs(strTmp, std::ios::trunc);
+		if (!ofs)
+			return;
+
+		ofs << "# redis cluster slot map" << std::endl;
+		for (auto &slotReg : vecSlot)
 		{
-			m_condAny.notify_all();
+			ofs << slotReg.nStartSlot << " " << slotReg.nEndSlot << " " << slotReg.strHost << " " << slotReg.nPort;
+			for (auto &slavePair : slotReg.vecSlave)
+				ofs << " " << slavePair.first << " " << slavePair.second;
+			ofs << std::endl;
 		}
-		safeLock.ReadUnlock();
+		if (!ofs)
+			return;
 	}
+	// rename replaces the old snapshot atomically, only windows refuses an existing target
+#if defined(_WIN32)
+	std::remove(m_strSnapshot.c_str());
+#endif
+	std::rename(strTmp.c_str(), m_strSnapshot.c_str());
+}
+
+// one retry after a broken node (or a redirect in cluster mode), if the deadline and the retry budget allow it
+bool CRedisClient::CanRetry(int nRet, const CRedisCommand *pRedisCmd)
+{
+	m_retryBudget.Deposit();
+	if (nRet != RC_RQST_ERR && !(m_bCluster && nRet == RC_REPLY_ERR && pRedisCmd->IsMovedErr()))
+		return false;
+	return !pRedisCmd->GetDeadline().Expired() && m_retryBudget.Withdraw();
+}
 
+// asks for a refresh without waiting for it, for callers which can not block
+void CRedisClient::RequestRefresh()
+{
+	std::lock_guard<std::mutex> guard(m_mutexRefresh);
+	if (!m_bRefreshRequested)
+	{
+		m_bRefreshRequested = true;
+		m_condRefresh.notify_all();
+	}
+}
 
-    int nRetry = WAIT_RETRY_TIMES;
-    while (!m_bValid && nRetry-- > 0)
-        std::this_thread::sleep_for(std::chrono::milliseconds(100));
-    return m_bValid;
+bool CRedisClient::WaitForRefresh(const CDeadline &deadline)
+{
+	std::unique_lock<std::mutex> guard(m_mutexRefresh);
+	// single flight: failing callers share one pending refresh, a refresh already running
+	// may have read the old map so the caller waits for the one after it
+	uint64_t nTargetGen = m_nRefreshGen + (m_bRefreshing ? 2 : 1);
+	if (!m_bRefreshRequested)
+	{
+		m_bRefreshRequested = true;
+		m_condRefresh.notify_all();
+	}
+	bool bDone = m_condRefresh.wait_for(guard, std::chrono::milliseconds(deadline.CapMs(WAIT_RETRY_TIMES * 100)),
+		[&]() { return m_bExit || m_nRefreshGen >= nTargetGen; });
+	return m_bValid && (bDone || !deadline.IsSet());
 }
 
 void CRedisClient::CleanServer()
@@ -2271,18 +5431,12 @@ int CRedisClient::Execute(CRedisCommand *pRedisCmd)
         return RC_RQST_ERR;
 
     int nRet = SimpleExecute(pRedisCmd);
-    if (!m_bCluster)
+    if (CanRetry(nRet, pRedisCmd))
     {
-        if (nRet == RC_RQST_ERR && WaitForRefresh())
+        if (WaitForRefresh(pRedisCmd->GetDeadline()))
             return SimpleExecute(pRedisCmd);
-    }
-    else
-    {
-        if ((nRet == RC_REPLY_ERR && pRedisCmd->IsMovedErr()) || nRet == RC_RQST_ERR)
-        {
-            if (WaitForRefresh())
-                return SimpleExecute(pRedisCmd);
-        }
+        if (pRedisCmd->GetDeadline().Expired())
+            return RC_TIMEOUT;
     }
     return nRet;
 }
@@ -2300,18 +5454,12 @@ int CRedisClient::ExecutePool(CRedisConnection* connection, CRedisCommand *pRedi
 	{
 		//client_log_error("CRedisClient::Execute SimpleExecute failed");
 	}
-	if (!m_bCluster)
+	if (CanRetry(nRet, pRedisCmd))
 	{
-		if (nRet == RC_RQST_ERR && WaitForRefresh())
+		if (WaitForRefresh(pRedisCmd->GetDeadline()))
 			return SimpleExecute(connection, pRedisCmd);
-	}
-	else
-	{
-		if ((nRet == RC_REPLY_ERR && pRedisCmd->IsMovedErr()) || nRet == RC_RQST_ERR)
-		{
-			if (WaitForRefresh())
-				return SimpleExecute(connection, pRedisCmd);
-		}
+		if (pRedisCmd->GetDeadline().Expired())
+			return RC_TIMEOUT;
 	}
 	return nRet;
 }
@@ -2391,23 +5539,27 @@ CRedisServer * CRedisClient::GetMatchedServer(const CRedisCommand *pRedisCmd) co
     }
 }
 
-CRedisServer * CRedisClient::FindServer(int nSlot) const
+CRedisServer * CRedisClient::GetMatchedSlave(const CRedisCommand *pRedisCmd) const
 {
-	//auto pairIter = std::equal_range(m_vecSlot.begin(), m_vecSlot.end(), nSlot, CompSlot());
-	//if (pairIter.first != m_vecSlot.end() && pairIter.first != pairIter.second)
-	//	return pairIter.first->pRedisServ;
-	//else
-	//	return nullptr;
-	for (auto elm : m_vecSlot)
+	if (!m_bCluster)
+		return m_vecSlaveServ->empty() ? nullptr : m_vecSlaveServ->at(0);
+	for (auto &elm : m_vecSlot)
 	{
-		if (elm.nStartSlot <= nSlot && nSlot <= elm.nEndSlot)
-		{
-			return elm.pRedisServ;
-		}
+		if (elm.nStartSlot <= pRedisCmd->GetSlot() && pRedisCmd->GetSlot() <= elm.nEndSlot)
+			return elm.pSlaveServ;
 	}
 	return nullptr;
 }
 
+CRedisServer * CRedisClient::FindServer(int nSlot) const
+{
+	// the slot map is sorted, a shard ring splits it into a few hundred regions per node
+	auto itSlot = std::upper_bound(m_vecSlot.begin(), m_vecSlot.end(), nSlot, CompSlot());
+	if (itSlot == m_vecSlot.begin() || (--itSlot)->nEndSlot < nSlot)
+		return nullptr;
+	return itSlot->pRedisServ;
+}
+
 CRedisServer * CRedisClient::FindServer(const std::vector<CRedisServer *> *vecRedisServ, const std::string &strHost, int nPort)
 {
     //for (auto &pRedisServ : vecRedisServ)
@@ -2420,39 +5572,49 @@ CRedisServer * CRedisClient::FindServer(const std::vector<CRedisServer *> *vecRe
     return nullptr;
 }
 
+// a known node id must match as well, a node replaced at the same address gets a new pool
+CRedisServer * CRedisClient::FindServer(const std::vector<CRedisServer *> *vecRedisServ, const std::string &strNodeId,
+	const std::string &strHost, int nPort)
+{
+	CRedisServer *pRedisServ = FindServer(vecRedisServ, strHost, nPort);
+	if (pRedisServ && !strNodeId.empty() && !pRedisServ->GetNodeId().empty() && strNodeId != pRedisServ->GetNodeId())
+		return nullptr;
+	return pRedisServ;
+}
+
 bool CRedisClient::InSameNode(const std::string &strKey1, const std::string &strKey2)
 {
     return m_bCluster ? FindServer(HASH_SLOT(strKey1)) == FindServer(HASH_SLOT(strKey2)) : true;
 }
 
-int CRedisClient::Watch(CRedisConnection* connection, const std::string &strKey)
+int CRedisClient::Watch(CRedisConnection* connection, const CRedisKey &redisKey, const CDeadline &deadline)
 {
-	std::string command = "watch " + strKey;
-	return ExecuteImplPool(connection, command, HASH_SLOT(strKey), BIND_STR(nullptr));
+	std::string command = "watch " + redisKey.Str();
+	return ExecuteImplPool(connection, command, redisKey.Slot(), deadline, BIND_STR(nullptr));
 }
 
-int CRedisClient::Multi(CRedisConnection* connection, const std::string &strKey)
+int CRedisClient::Multi(CRedisConnection* connection, const CRedisKey &redisKey, const CDeadline &deadline)
 {
 	std::string command = "multi ";
-	return ExecuteImplPool(connection, command, HASH_SLOT(strKey), BIND_STR(nullptr), StuResConv());
+	return ExecuteImplPool(connection, command, redisKey.Slot(), deadline, BIND_STR(nullptr), StuResConv());
 }
 
-int CRedisClient::Exec(CRedisConnection* connection, const std::string &strKey, OUT RedisResult* result)
+int CRedisClient::Exec(CRedisConnection* connection, const CRedisKey &redisKey, OUT RedisResult* result, const CDeadline &deadline)
 {
 	std::string command = "exec";
-	return ExecuteImplPool(connection, command, HASH_SLOT(strKey), BIND_MULTI(result));
+	return ExecuteImplPool(connection, command, redisKey.Slot(), deadline, BIND_MULTI(result));
 }
 
-int CRedisClient::Unwatch(CRedisConnection* connection, const std::string &strKey)
+int CRedisClient::Unwatch(CRedisConnection* connection, const CRedisKey &redisKey, const CDeadline &deadline)
 {
 	std::string command = "unwatch ";
-	return ExecuteImplPool(connection, command, HASH_SLOT(strKey), BIND_STR(nullptr));
+	return ExecuteImplPool(connection, command, redisKey.Slot(), deadline, BIND_STR(nullptr));
 }
 
-int CRedisClient::Discard(CRedisConnection* connection, const std::string &strKey)
+int CRedisClient::Discard(CRedisConnection* connection, const CRedisKey &redisKey, const CDeadline &deadline)
 {
 	std::string command = "discard ";
-	return ExecuteImplPool(connection, command, HASH_SLOT(strKey), BIND_STR(nullptr));
+	return ExecuteImplPool(connection, command, redisKey.Slot(), deadline, BIND_STR(nullptr));
 }
 
 CRedisConnection* CRedisClient::AttachConnection(int slot)
@@ -2464,7 +5626,7 @@ CRedisConnection* CRedisClient::AttachConnection(int slot)
 		return nullptr;
 	}
 	//return server->FetchConnection();
-	auto ret = server->FetchConnection();
+	auto ret = server->FetchConnection(0, CRedisPriority::Current());
 	if (nullptr == ret)
 	{
 		//client_log_error("CRedisClient::AttachConnection fetch failed [slot:", slot, "]");